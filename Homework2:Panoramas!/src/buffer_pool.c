@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+
+// Pixel buffers are recycled instead of going back to malloc. Sizes are
+// rounded up to size classes, four per power of two, so a buffer fits
+// any request of its class and wastes at most a fifth of itself. Freed
+// buffers first go to a small cache of the freeing thread, which needs
+// no lock, then to a global free list per class. Once the pool holds
+// more than its limit, freed buffers go back to the system.
+//
+// Every buffer starts with a header of IMAGE_ALIGN bytes that records
+// its class, so the pixels after it stay aligned and free_pixels needs
+// nothing but the pointer.
+
+#define POOL_MIN_BYTES 256
+#define POOL_CLASSES (1 + 4 * 40)
+#define POOL_CACHE_DEPTH 2
+#define POOL_DEFAULT_LIMIT ((size_t)256 << 20)
+
+typedef struct pool_header{
+    int cls;                    // size class, POOL_CLASSES if unpooled
+    size_t bytes;               // usable bytes after the header
+    struct pool_header *next;   // next free buffer of the class
+} pool_header;
+
+typedef struct{
+    pool_header *free[POOL_CLASSES];
+    int count[POOL_CLASSES];
+} thread_cache;
+
+static pthread_mutex_t pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_header *pool_free[POOL_CLASSES];
+static size_t pool_limit = POOL_DEFAULT_LIMIT;
+
+// statistics, updated with atomics
+static size_t pool_hits, pool_misses, pool_resident, pool_in_use;
+
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread thread_cache *cache = 0;
+
+// Size class of a request and the usable size of buffers of that class.
+// size_t bytes: size of the request.
+// size_t *class_bytes: set to the size of the class.
+// returns: the class, or POOL_CLASSES if it is too large for any.
+int pool_size_class(size_t bytes, size_t *class_bytes)
+{
+    if (bytes <= POOL_MIN_BYTES)
+    {
+        *class_bytes = POOL_MIN_BYTES;
+        return 0;
+    }
+    // 2^k < bytes <= 2^(k + 1), split into four steps
+    int k = 63 - __builtin_clzl(bytes - 1);
+    size_t step = (size_t)1 << (k - 2);
+    size_t j = (bytes - ((size_t)1 << k) + step - 1) / step;
+    int cls = 1 + (k - 8) * 4 + (int)(j - 1);
+    *class_bytes = cls < POOL_CLASSES ? ((size_t)1 << k) + j * step : bytes;
+    return MIN(cls, POOL_CLASSES);
+}
+
+static inline pool_header *header_of(void *data)
+{
+    return (pool_header *)((char *)data - IMAGE_ALIGN);
+}
+
+static inline void *data_of(pool_header *h)
+{
+    return (char *)h + IMAGE_ALIGN;
+}
+
+// Frees a buffer for good.
+void release_buffer(pool_header *h)
+{
+    free(h);
+}
+
+// Puts a buffer on the global list of its class, or releases it when
+// the pool is full.
+void push_global(pool_header *h)
+{
+    size_t resident = __atomic_load_n(&pool_resident, __ATOMIC_RELAXED);
+    if (resident + h->bytes > __atomic_load_n(&pool_limit, __ATOMIC_RELAXED))
+    {
+        release_buffer(h);
+        return;
+    }
+    __atomic_add_fetch(&pool_resident, h->bytes, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pool_list_lock);
+    h->next = pool_free[h->cls];
+    pool_free[h->cls] = h;
+    pthread_mutex_unlock(&pool_list_lock);
+}
+
+// Moves everything in a thread cache to the global lists.
+void flush_cache(thread_cache *tc)
+{
+    for (int cls = 0; cls < POOL_CLASSES; cls++)
+    {
+        while (tc->free[cls])
+        {
+            pool_header *h = tc->free[cls];
+            tc->free[cls] = h->next;
+            // push_global counts it again
+            __atomic_sub_fetch(&pool_resident, h->bytes, __ATOMIC_RELAXED);
+            push_global(h);
+        }
+        tc->count[cls] = 0;
+    }
+}
+
+// Runs when a thread that used the pool exits. A buffer freed later in
+// the thread's teardown makes a new cache, which pthreads destroys in
+// its next round of destructors.
+void destroy_cache(void *tc)
+{
+    flush_cache(tc);
+    free(tc);
+    cache = 0;
+}
+
+void make_cache_key()
+{
+    pthread_key_create(&cache_key, destroy_cache);
+}
+
+// returns: the thread cache of the calling thread, made on first use.
+thread_cache *get_cache()
+{
+    if (!cache)
+    {
+        pthread_once(&cache_key_once, make_cache_key);
+        cache = calloc(1, sizeof(thread_cache));
+        pthread_setspecific(cache_key, cache);
+    }
+    return cache;
+}
+
+// Allocates a buffer aligned to IMAGE_ALIGN, zeroed if zero is set,
+// from the buffer pool when it has one of the right class.
+// Free it with free_buffer.
+// size_t size: bytes needed.
+void *alloc_buffer(size_t size, int zero)
+{
+    size_t bytes;
+    int cls = pool_size_class(MAX(size, 1), &bytes);
+    pool_header *h = 0;
+    if (cls < POOL_CLASSES)
+    {
+        thread_cache *tc = get_cache();
+        if (tc->free[cls])
+        {
+            h = tc->free[cls];
+            tc->free[cls] = h->next;
+            tc->count[cls]--;
+        }
+        else
+        {
+            pthread_mutex_lock(&pool_list_lock);
+            h = pool_free[cls];
+            if (h)
+                pool_free[cls] = h->next;
+            pthread_mutex_unlock(&pool_list_lock);
+        }
+    }
+
+    if (h)
+    {
+        __atomic_add_fetch(&pool_hits, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&pool_resident, h->bytes, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        void *block = 0;
+        if (posix_memalign(&block, IMAGE_ALIGN, IMAGE_ALIGN + bytes))
+            return 0;
+        h = block;
+        h->cls = cls;
+        h->bytes = bytes;
+        __atomic_add_fetch(&pool_misses, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&pool_in_use, h->bytes, __ATOMIC_RELAXED);
+
+    void *data = data_of(h);
+    if (zero)
+        memset(data, 0, size);
+    return data;
+}
+
+// Gives a buffer from alloc_buffer back to the pool.
+void free_buffer(void *data)
+{
+    if (!data)
+        return;
+    pool_header *h = header_of(data);
+    __atomic_sub_fetch(&pool_in_use, h->bytes, __ATOMIC_RELAXED);
+    if (h->cls == POOL_CLASSES)
+    {
+        release_buffer(h);
+        return;
+    }
+
+    thread_cache *tc = get_cache();
+    if (tc->count[h->cls] < POOL_CACHE_DEPTH &&
+        __atomic_load_n(&pool_resident, __ATOMIC_RELAXED) + h->bytes <= __atomic_load_n(&pool_limit, __ATOMIC_RELAXED))
+    {
+        __atomic_add_fetch(&pool_resident, h->bytes, __ATOMIC_RELAXED);
+        h->next = tc->free[h->cls];
+        tc->free[h->cls] = h;
+        tc->count[h->cls]++;
+        return;
+    }
+    push_global(h);
+}
+
+// alloc_buffer for n floats, free them with free_pixels.
+float *alloc_pixels(size_t n, int zero)
+{
+    return alloc_buffer(n * sizeof(float), zero);
+}
+
+void free_pixels(float *data)
+{
+    free_buffer(data);
+}
+
+// Releases idle buffers until the pool holds at most keep bytes. The
+// cache of the calling thread is emptied first, buffers cached by other
+// threads stay where they are.
+// size_t keep: bytes the pool may keep, 0 to release everything it can.
+void trim_buffer_pool(size_t keep)
+{
+    if (cache)
+        flush_cache(cache);
+    pthread_mutex_lock(&pool_list_lock);
+    // the largest buffers go first
+    for (int cls = POOL_CLASSES - 1; cls >= 0; cls--)
+    {
+        while (pool_free[cls] && __atomic_load_n(&pool_resident, __ATOMIC_RELAXED) > keep)
+        {
+            pool_header *h = pool_free[cls];
+            pool_free[cls] = h->next;
+            __atomic_sub_fetch(&pool_resident, h->bytes, __ATOMIC_RELAXED);
+            release_buffer(h);
+        }
+    }
+    pthread_mutex_unlock(&pool_list_lock);
+}
+
+// Sets how many idle bytes the pool may hold, 256 MB by default. Past
+// that, freed buffers go back to the system, so 0 turns pooling off.
+// Buffers already held above the new limit are released.
+void set_buffer_pool_limit(size_t bytes)
+{
+    __atomic_store_n(&pool_limit, bytes, __ATOMIC_RELAXED);
+    trim_buffer_pool(bytes);
+}
+
+// returns: hit and miss counts and byte totals of the pool so far.
+buffer_pool_stats get_buffer_pool_stats()
+{
+    buffer_pool_stats s;
+    s.hits = __atomic_load_n(&pool_hits, __ATOMIC_RELAXED);
+    s.misses = __atomic_load_n(&pool_misses, __ATOMIC_RELAXED);
+    s.resident = __atomic_load_n(&pool_resident, __ATOMIC_RELAXED);
+    s.in_use = __atomic_load_n(&pool_in_use, __ATOMIC_RELAXED);
+    return s;
+}
@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "fft.h"
+#include "parallel.h"
+
+// How much slower a transform multiply-add is than a direct one, for
+// fft_convolution_cheaper. Measured on x86-64 with -Ofast.
+#define FFT_COST_RATIO 3
+
+// Smallest length >= n whose only prime factors are 2, 3 and 5,
+// the lengths the FFT below handles with its fast butterflies.
+int fft_size(int n)
+{
+    for (;; n++)
+    {
+        int r = n;
+        while (r % 2 == 0)
+            r /= 2;
+        while (r % 3 == 0)
+            r /= 3;
+        while (r % 5 == 0)
+            r /= 5;
+        if (r == 1)
+            return n;
+    }
+}
+
+// Makes a plan for transforms of length n.
+// Radix 4 stages are used first, then 2, 3, 5 and whatever primes are left.
+// int n: transform length.
+// int inverse: 0 for exp(-2 pi i k / n) twiddles, 1 for the inverse.
+// returns: the plan, free it with free_fft_plan.
+fft_plan make_fft_plan(int n, int inverse)
+{
+    fft_plan p;
+    p.n = n;
+    p.inverse = inverse;
+    p.twiddles = calloc(n, sizeof(float complex));
+    double sign = inverse ? 1 : -1;
+    for (int k = 0; k < n; k++)
+    {
+        double phase = sign * TWOPI * k / n;
+        p.twiddles[k] = cos(phase) + I * sin(phase);
+    }
+
+    int *f = p.factors;
+    int radix = 4;
+    int m = n;
+    do
+    {
+        while (m % radix)
+        {
+            radix = radix == 4 ? 2 : radix == 2 ? 3 : radix + 2;
+            if (radix * radix > m)
+                radix = m;
+        }
+        m /= radix;
+        *f++ = radix;
+        *f++ = m;
+    } while (m > 1);
+    return p;
+}
+
+void free_fft_plan(fft_plan p)
+{
+    free(p.twiddles);
+}
+
+void fft_butterfly2(fft_plan p, float complex *out, int stride, int m)
+{
+    const float complex *tw = p.twiddles;
+    for (int k = 0; k < m; k++)
+    {
+        float complex t = out[k + m] * tw[k * stride];
+        out[k + m] = out[k] - t;
+        out[k] += t;
+    }
+}
+
+void fft_butterfly4(fft_plan p, float complex *out, int stride, int m)
+{
+    const float complex *tw = p.twiddles;
+    // -i for the forward transform, +i for the inverse
+    float complex rot = p.inverse ? I : -I;
+    for (int k = 0; k < m; k++)
+    {
+        float complex s0 = out[k + m] * tw[k * stride];
+        float complex s1 = out[k + 2 * m] * tw[2 * k * stride];
+        float complex s2 = out[k + 3 * m] * tw[3 * k * stride];
+        float complex s5 = out[k] - s1;
+        float complex s4 = out[k] + s1;
+        float complex s3 = s0 + s2;
+        float complex s6 = (s0 - s2) * rot;
+        out[k] = s4 + s3;
+        out[k + 2 * m] = s4 - s3;
+        out[k + m] = s5 + s6;
+        out[k + 3 * m] = s5 - s6;
+    }
+}
+
+// Radix p butterfly as a direct p point DFT, O(p^2) but p is 3 or 5.
+void fft_butterfly(fft_plan p, float complex *out, int stride, int m, int radix)
+{
+    const float complex *tw = p.twiddles;
+    float complex scratch[radix];
+    for (int u = 0; u < m; u++)
+    {
+        for (int q = 0; q < radix; q++)
+            scratch[q] = out[u + q * m];
+        for (int q = 0; q < radix; q++)
+        {
+            int k = u + q * m;
+            int index = 0;
+            float complex sum = scratch[0];
+            for (int j = 1; j < radix; j++)
+            {
+                index += stride * k;
+                if (index >= p.n)
+                    index %= p.n;
+                sum += scratch[j] * tw[index];
+            }
+            out[k] = sum;
+        }
+    }
+}
+
+// Decimation in time: transform the radix interleaved subsequences
+// recursively into consecutive blocks of out, then combine the blocks.
+void fft_work(fft_plan p, float complex *out, const float complex *in, int stride, const int *factors)
+{
+    int radix = factors[0];
+    int m = factors[1];
+    if (m == 1)
+    {
+        for (int q = 0; q < radix; q++)
+            out[q] = in[q * stride];
+    }
+    else
+    {
+        for (int q = 0; q < radix; q++)
+            fft_work(p, out + q * m, in + q * stride, stride * radix, factors + 2);
+    }
+
+    if (radix == 2)
+        fft_butterfly2(p, out, stride, m);
+    else if (radix == 4)
+        fft_butterfly4(p, out, stride, m);
+    else
+        fft_butterfly(p, out, stride, m, radix);
+}
+
+// Transforms in into out, out of place. The inverse is not scaled by 1 / n.
+void fft(fft_plan p, const float complex *in, float complex *out)
+{
+    assert(in != out);
+    fft_work(p, out, in, 1, p.factors);
+}
+
+// Arguments of the row and column passes of rfft2d / irfft2d for parallel_for.
+typedef struct{
+    const float *src;
+    float *dst;
+    float complex *spectrum;
+    int n, m;
+    fft_plan plan;
+    float scale;
+} fft2d_job;
+
+// Row pairs p0 .. p1 - 1 (rows 2p and 2p + 1) of rfft2d.
+void rfft2d_rows(void *ctx, int p0, int p1)
+{
+    fft2d_job *job = ctx;
+    int n = job->n;
+    int m = job->m;
+    int half = n / 2 + 1;
+    float complex *z = calloc(n, sizeof(float complex));
+    float complex *Z = calloc(n, sizeof(float complex));
+    for (int y = 2 * p0; y < MIN(2 * p1, m); y += 2)
+    {
+        const float *a = job->src + y * n;
+        const float *b = y + 1 < m ? job->src + (y + 1) * n : 0;
+        for (int x = 0; x < n; x++)
+            z[x] = a[x] + I * (b ? b[x] : 0);
+        fft(job->plan, z, Z);
+
+        // separate the two real transforms again
+        float complex *A = job->spectrum + y * half;
+        float complex *B = job->spectrum + (y + 1) * half;
+        for (int k = 0; k < half; k++)
+        {
+            float complex Zk = Z[k];
+            float complex Zc = conjf(Z[(n - k) % n]);
+            A[k] = 0.5f * (Zk + Zc);
+            if (b)
+                B[k] = -0.5f * I * (Zk - Zc);
+        }
+    }
+    free(z);
+    free(Z);
+}
+
+// Columns k0 .. k1 - 1 of the spectrum, transformed in place.
+void fft2d_cols(void *ctx, int k0, int k1)
+{
+    fft2d_job *job = ctx;
+    int m = job->m;
+    int half = job->n / 2 + 1;
+    float complex *z = calloc(m, sizeof(float complex));
+    float complex *Z = calloc(m, sizeof(float complex));
+    for (int k = k0; k < k1; k++)
+    {
+        for (int y = 0; y < m; y++)
+            z[y] = job->spectrum[k + y * half];
+        fft(job->plan, z, Z);
+        for (int y = 0; y < m; y++)
+            job->spectrum[k + y * half] = Z[y];
+    }
+    free(z);
+    free(Z);
+}
+
+// Row pairs p0 .. p1 - 1 (rows 2p and 2p + 1) of irfft2d.
+void irfft2d_rows(void *ctx, int p0, int p1)
+{
+    fft2d_job *job = ctx;
+    int n = job->n;
+    int m = job->m;
+    int half = n / 2 + 1;
+    float complex *z = calloc(n, sizeof(float complex));
+    float complex *Z = calloc(n, sizeof(float complex));
+    for (int y = 2 * p0; y < MIN(2 * p1, m); y += 2)
+    {
+        // every row is real again, so its spectrum is hermitian
+        const float complex *A = job->spectrum + y * half;
+        const float complex *B = y + 1 < m ? job->spectrum + (y + 1) * half : 0;
+        for (int k = 0; k < half; k++)
+            Z[k] = A[k] + (B ? I * B[k] : 0);
+        for (int k = half; k < n; k++)
+            Z[k] = conjf(A[n - k]) + (B ? I * conjf(B[n - k]) : 0);
+        fft(job->plan, Z, z);
+
+        for (int x = 0; x < n; x++)
+            job->dst[x + y * n] = crealf(z[x]) * job->scale;
+        if (B)
+            for (int x = 0; x < n; x++)
+                job->dst[x + (y + 1) * n] = cimagf(z[x]) * job->scale;
+    }
+    free(z);
+    free(Z);
+}
+
+// 2d FFT of a real n x m plane (row-major, n wide). Only the n / 2 + 1
+// non-negative frequencies of each row are kept, the rest follow from
+// hermitian symmetry. Rows are transformed two at a time, packed as
+// the real and imaginary part of one complex row.
+// const float *src: the plane.
+// float complex *spectrum: m rows of n / 2 + 1 values.
+void rfft2d(const float *src, int n, int m, float complex *spectrum)
+{
+    int half = n / 2 + 1;
+    double row_cost = 5. * n * log2(n);
+    double col_cost = 5. * m * log2(m);
+    fft2d_job job = {src, 0, spectrum, n, m, make_fft_plan(n, 0)};
+    parallel_for((m + 1) / 2, parallel_grain(row_cost), rfft2d_rows, &job);
+    free_fft_plan(job.plan);
+
+    job.plan = make_fft_plan(m, 0);
+    parallel_for(half, parallel_grain(col_cost), fft2d_cols, &job);
+    free_fft_plan(job.plan);
+}
+
+// Inverse of rfft2d, including the 1 / (n m) scaling.
+// float complex *spectrum: m rows of n / 2 + 1 values, overwritten.
+// float *dst: the n x m real plane.
+void irfft2d(float complex *spectrum, int n, int m, float *dst)
+{
+    int half = n / 2 + 1;
+    double row_cost = 5. * n * log2(n);
+    double col_cost = 5. * m * log2(m);
+    fft2d_job job = {0, dst, spectrum, n, m, make_fft_plan(m, 1)};
+    job.scale = 1. / ((double)n * m);
+    parallel_for(half, parallel_grain(col_cost), fft2d_cols, &job);
+    free_fft_plan(job.plan);
+
+    job.plan = make_fft_plan(n, 1);
+    parallel_for((m + 1) / 2, parallel_grain(row_cost), irfft2d_rows, &job);
+    free_fft_plan(job.plan);
+}
+
+// Copies a plane into the top left of an n x m buffer, shifted by
+// (dx, dy) and clamp padded all the way to the buffer edges.
+void pad_plane(const float *src, int w, int h, int dx, int dy, float *dst, int n, int m)
+{
+    for (int y = 0; y < m; y++)
+    {
+        const float *row = src + clamp_padding(y - dy, 0, h) * w;
+        for (int x = 0; x < n; x++)
+            dst[x + y * n] = row[clamp_padding(x - dx, 0, w)];
+    }
+}
+
+// Cost model choosing between convolve_fft and direct convolution.
+// Direct costs w h fw fh multiply-adds per input channel. A transform
+// of size n m costs about 2.5 n m log2(n m), and convolve_fft needs one
+// per image plane it transforms, per distinct filter channel and per
+// output channel.
+// returns: 1 if the frequency domain is expected to be faster.
+int fft_convolution_cheaper(image im, image filter, int preserve)
+{
+    int numOfChannel = preserve == 1 ? im.c : 1;
+    int planes = filter.c == 1 ? numOfChannel : im.c;
+    int transforms = planes + filter.c + numOfChannel;
+    double n = fft_size(im.w + filter.w - 1);
+    double m = fft_size(im.h + filter.h - 1);
+    double direct = (double)im.w * im.h * filter.w * filter.h * im.c;
+    double frequency = transforms * 2.5 * n * m * log2(n * m);
+    return FFT_COST_RATIO * frequency < direct;
+}
+
+// Convolves an image in the frequency domain. Same result as
+// convolve_image: the image is clamp padded by the filter size before
+// the transform, which also keeps the circular convolution from
+// wrapping around. Cost grows with log of the filter size instead of
+// its area, so it wins for large non-separable filters.
+// image im: image to convolve.
+// image filter: filter, 1 channel or as many as im.
+// int preserve: whether to keep the channels of im or sum them into one.
+// returns: the convolved image.
+image convolve_fft(image im, image filter, int preserve)
+{
+    assert(im.c == filter.c || filter.c == 1);
+    // the paths below index planes directly
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        image out = convolve_fft(planar, filter, preserve);
+        free_image(planar);
+        set_layout(&out, im.layout);
+        return out;
+    }
+    int numOfChannel = preserve == 1 ? im.c : 1;
+    int n = fft_size(im.w + filter.w - 1);
+    int m = fft_size(im.h + filter.h - 1);
+    size_t bins = (size_t)(n / 2 + 1) * m;
+    int plane = im.w * im.h;
+    int dx = filter.w / 2;
+    int dy = filter.h / 2;
+
+    image convolved = make_image(im.w, im.h, numOfChannel);
+    float *padded = calloc((size_t)n * m, sizeof(float));
+    float *sum = calloc(plane, sizeof(float));
+    float complex *spectrum = calloc(bins, sizeof(float complex));
+    float complex *kernel = calloc(bins, sizeof(float complex));
+    float complex *acc = calloc(bins, sizeof(float complex));
+
+    int kernel_channel = -1;
+    for (int k = 0; k < numOfChannel; k++)
+    {
+        int c0 = numOfChannel > 1 ? k : 0;
+        int c1 = numOfChannel > 1 ? k + 1 : im.c;
+        memset(acc, 0, bins * sizeof(float complex));
+        for (int c = c0; c < c1; c++)
+        {
+            int fc = filter.c > 1 ? c : 0;
+            if (fc != kernel_channel)
+            {
+                memset(padded, 0, (size_t)n * m * sizeof(float));
+                for (int y = 0; y < filter.h; y++)
+                    for (int x = 0; x < filter.w; x++)
+                        padded[x + y * n] = filter.data[x + y * filter.w + fc * filter.w * filter.h];
+                rfft2d(padded, n, m, kernel);
+                kernel_channel = fc;
+            }
+
+            const float *src = im.data + c * plane;
+            if (filter.c == 1 && c1 - c0 > 1)
+            {
+                // the filter is shared, so by linearity
+                // sum the channels and transform once
+                memset(sum, 0, plane * sizeof(float));
+                for (int cc = c0; cc < c1; cc++)
+                    for (int i = 0; i < plane; i++)
+                        sum[i] += im.data[i + cc * plane];
+                src = sum;
+                c = c1;
+            }
+            pad_plane(src, im.w, im.h, dx, dy, padded, n, m);
+            rfft2d(padded, n, m, spectrum);
+
+            // out(x, y) = sum padded(x + fx, y + fy) f(fx, fy) is a
+            // correlation, the conjugate of the kernel spectrum
+            for (size_t i = 0; i < bins; i++)
+                acc[i] += spectrum[i] * conjf(kernel[i]);
+        }
+        irfft2d(acc, n, m, padded);
+        for (int y = 0; y < im.h; y++)
+            memcpy(convolved.data + k * plane + y * im.w, padded + y * n, im.w * sizeof(float));
+    }
+
+    free(padded);
+    free(sum);
+    free(spectrum);
+    free(kernel);
+    free(acc);
+    return convolved;
+}
@@ -0,0 +1,23 @@
+#ifndef FFT_H
+#define FFT_H
+#include <complex.h>
+
+// A mixed radix FFT of one length, see fft.c.
+// int n: transform length.
+// int inverse: whether it computes the (unscaled) inverse transform.
+// int factors: radix / remaining length pairs of the decomposition.
+// float complex *twiddles: the n roots of unity it uses.
+typedef struct fft_plan{
+    int n;
+    int inverse;
+    int factors[64];
+    float complex *twiddles;
+} fft_plan;
+
+int fft_size(int n);
+fft_plan make_fft_plan(int n, int inverse);
+void free_fft_plan(fft_plan p);
+void fft(fft_plan p, const float complex *in, float complex *out);
+void rfft2d(const float *src, int n, int m, float complex *spectrum);
+void irfft2d(float complex *spectrum, int n, int m, float *dst);
+#endif
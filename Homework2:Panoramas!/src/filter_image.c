@@ -4,8 +4,21 @@
 #include <math.h>
 #include <assert.h>
 #include "image.h"
+#include "simd.h"
+#include "parallel.h"
 #define TWOPI 6.2831853
 
+// Output tile of the direct convolution. A tile row of floats plus the
+// filter rows it reads fits in L1, the input band of a tile fits in L2.
+#define CONV_TILE_W 256
+#define CONV_TILE_H 32
+
+// Constant filters with at least this many taps go through summed area tables
+#define BOX_SAT_MIN 49
+
+// Filters with fewer taps than this never try the FFT path
+#define FFT_MIN_TAPS 121
+
 void l1_normalize(image im)
 {
     for (int c = 0; c < im.c; c++)
@@ -45,11 +58,414 @@ image make_box_filter(int w)
     return filter;
 }
 
+// Arguments of convolve_rows_1d / convolve_cols_1d for parallel_for.
+typedef struct{
+    const float *src;
+    float *dst;
+    int w, h;
+    const float *k;
+    int n;
+} conv1d_job;
+
+// Output rows y0 .. y1 - 1 of convolve_rows_1d.
+void convolve_rows_1d_band(void *ctx, int y0, int y1)
+{
+    conv1d_job *job = ctx;
+    const float *src = job->src;
+    float *dst = job->dst;
+    const float *k = job->k;
+    int w = job->w;
+    int n = job->n;
+    int r = n / 2;
+    for (int y = y0; y < y1; y++)
+    {
+        const float *in = src + y * w;
+        float *out = dst + y * w;
+        for (int x = 0; x < w; x++)
+        {
+            float sum = 0;
+            if (x - r >= 0 && x - r + n <= w)
+            {
+                // interior, every tap is inside the row
+                const float *p = in + x - r;
+                for (int i = 0; i < n; i++)
+                    sum += p[i] * k[i];
+            }
+            else
+            {
+                for (int i = 0; i < n; i++)
+                    sum += in[clamp_padding(x + i - r, 0, w)] * k[i];
+            }
+            out[x] = sum;
+        }
+    }
+}
+
+// Convolves every row of a plane with a 1d filter.
+// Columns that fall off the left or right edge are clamped to the border.
+// const float *src: input plane, w x h.
+// float *dst: output plane, w x h.
+// const float *k: filter taps, n of them, centered on n / 2.
+void convolve_rows_1d(const float *src, float *dst, int w, int h, const float *k, int n)
+{
+    conv1d_job job = {src, dst, w, h, k, n};
+    parallel_for(h, parallel_grain((double)w * n), convolve_rows_1d_band, &job);
+}
+
+// Output rows y0 .. y1 - 1 of convolve_cols_1d.
+void convolve_cols_1d_band(void *ctx, int y0, int y1)
+{
+    conv1d_job *job = ctx;
+    const float *src = job->src;
+    float *dst = job->dst;
+    const float *k = job->k;
+    int w = job->w;
+    int h = job->h;
+    int n = job->n;
+    int r = n / 2;
+    for (int y = y0; y < y1; y++)
+    {
+        float *out = dst + y * w;
+        for (int x = 0; x < w; x++)
+            out[x] = 0;
+        for (int i = 0; i < n; i++)
+        {
+            const float *in = src + clamp_padding(y + i - r, 0, h) * w;
+            float tap = k[i];
+            for (int x = 0; x < w; x++)
+                out[x] += in[x] * tap;
+        }
+    }
+}
+
+// Convolves every column of a plane with a 1d filter.
+// Rows that fall off the top or bottom edge are clamped to the border.
+// Works a full output row at a time so the inner loop stays contiguous.
+// const float *src: input plane, w x h.
+// float *dst: output plane, w x h.
+// const float *k: filter taps, n of them, centered on n / 2.
+void convolve_cols_1d(const float *src, float *dst, int w, int h, const float *k, int n)
+{
+    conv1d_job job = {src, dst, w, h, k, n};
+    parallel_for(h, parallel_grain((double)w * n), convolve_cols_1d_band, &job);
+}
+
+// Splits a 1 channel filter into a row filter and a column filter
+// if it is rank 1, i.e. filter(x, y) = col[y] * row[x].
+// Gaussian, box and sobel filters all split this way.
+// image filter: the filter to split.
+// image *row: filled with a filter.w x 1 filter on success.
+// image *col: filled with a 1 x filter.h filter on success.
+// returns: 1 if the filter is separable, 0 otherwise.
+int separate_filter(image filter, image *row, image *col)
+{
+    if (filter.c != 1)
+        return 0;
+
+    // pivot on the largest entry so the division below is well conditioned
+    int n = filter.w * filter.h;
+    int pivot = 0;
+    for (int i = 1; i < n; i++)
+    {
+        if (fabsf(filter.data[i]) > fabsf(filter.data[pivot]))
+            pivot = i;
+    }
+    float maxi = fabsf(filter.data[pivot]);
+    if (maxi == 0)
+        return 0;
+    int px = pivot % filter.w;
+    int py = pivot / filter.w;
+
+    image r = make_image(filter.w, 1, 1);
+    image c = make_image(1, filter.h, 1);
+    for (int x = 0; x < filter.w; x++)
+        r.data[x] = filter.data[x + py * filter.w];
+    for (int y = 0; y < filter.h; y++)
+        c.data[y] = filter.data[px + y * filter.w] / filter.data[pivot];
+
+    // the outer product has to reproduce every entry up to float rounding
+    float tolerance = 1e-5 * maxi;
+    for (int y = 0; y < filter.h; y++)
+    {
+        for (int x = 0; x < filter.w; x++)
+        {
+            if (fabsf(filter.data[x + y * filter.w] - c.data[y] * r.data[x]) > tolerance)
+            {
+                free_image(r);
+                free_image(c);
+                return 0;
+            }
+        }
+    }
+    *row = r;
+    *col = c;
+    return 1;
+}
+
+// Convolves an image with a separable filter: a horizontal pass with row
+// followed by a vertical pass with col. Same padding and channel semantics
+// as convolve_image, at n + m instead of n * m multiply-adds per pixel.
+// image im: image to convolve.
+// image row: 1d filter applied along x, any shape with row.w * row.h taps.
+// image col: 1d filter applied along y, any shape with col.w * col.h taps.
+// int preserve: whether to keep the channels of im or sum them into one.
+// returns: the convolved image.
+image convolve_separable(image im, image row, image col, int preserve)
+{
+    assert(row.c == 1 && col.c == 1);
+    // the paths below index planes directly
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        image out = convolve_separable(planar, row, col, preserve);
+        free_image(planar);
+        set_layout(&out, im.layout);
+        return out;
+    }
+    int plane = im.w * im.h;
+    int numOfChannel = preserve == 1 ? im.c : 1;
+    image convolved = make_image(im.w, im.h, numOfChannel);
+    float *tmp = calloc(plane, sizeof(float));
+
+    if (numOfChannel == 1 && im.c > 1)
+    {
+        // convolution is linear, so summing the channels first gives the
+        // same result as convolving each one and summing afterwards
+        for (int c = 0; c < im.c; c++)
+            for (int i = 0; i < plane; i++)
+                convolved.data[i] += im.data[i + c * plane];
+        convolve_rows_1d(convolved.data, tmp, im.w, im.h, row.data, row.w * row.h);
+        convolve_cols_1d(tmp, convolved.data, im.w, im.h, col.data, col.w * col.h);
+    }
+    else
+    {
+        for (int c = 0; c < numOfChannel; c++)
+        {
+            convolve_rows_1d(im.data + c * plane, tmp, im.w, im.h, row.data, row.w * row.h);
+            convolve_cols_1d(tmp, convolved.data + c * plane, im.w, im.h, col.data, col.w * col.h);
+        }
+    }
+    free(tmp);
+    return convolved;
+}
+
+// Whether every entry of a filter has the same value, as in a box filter.
+int constant_filter(image filter)
+{
+    for (int i = 1; i < filter.w * filter.h * filter.c; i++)
+    {
+        if (filter.data[i] != filter.data[0])
+            return 0;
+    }
+    return 1;
+}
+
+// Computes one output pixel of convolve_image, summing channels c0..c1-1.
+// Reads through get_pixel so it is safe anywhere, including the border.
+float convolve_pixel_clamped(image im, image filter, int c0, int c1, int x, int y)
+{
+    float sum = 0;
+    for (int c = c0; c < c1; c++)
+    {
+        int fc = filter.c > 1 ? c : 0;
+        for (int filter_w = 0; filter_w < filter.w; filter_w++)
+        {
+            int x_im = x + filter_w - filter.w / 2;
+            for (int filter_h = 0; filter_h < filter.h; filter_h++)
+            {
+                int y_im = y + filter_h - filter.h / 2;
+                sum += get_pixel(im, x_im, y_im, c) * get_pixel(filter, filter_w, filter_h, fc);
+            }
+        }
+    }
+    return sum;
+}
+
+// Accumulates n consecutive output pixels of convolve_image, starting at
+// (x, y), into acc. Every tap has to be inside the image, so there is no
+// clamping and the inner loop runs over contiguous memory. Taps are added
+// in the same order as convolve_pixel_clamped, which keeps the two paths
+// bit-for-bit identical.
+void convolve_span_interior(image im, image filter, int c0, int c1, int x, int y, int n, float *acc)
+{
+    int plane = im.w * im.h;
+    for (int c = c0; c < c1; c++)
+    {
+        int fc = filter.c > 1 ? c : 0;
+        const float *f = filter.data + fc * filter.w * filter.h;
+        for (int filter_w = 0; filter_w < filter.w; filter_w++)
+        {
+            int x_im = x + filter_w - filter.w / 2;
+            for (int filter_h = 0; filter_h < filter.h; filter_h++)
+            {
+                int y_im = y + filter_h - filter.h / 2;
+                const float *in = im.data + c * plane + y_im * im.w + x_im;
+                float tap = f[filter_w + filter_h * filter.w];
+                for (int i = 0; i < n; i++)
+                    acc[i] += in[i] * tap;
+            }
+        }
+    }
+}
+
+// Same as convolve_span_interior for a K x K filter with K known at
+// compile time. The K * K weights are broadcast into vector registers
+// once per channel and the window is fully unrolled, so each output
+// vector costs K * K loads and multiply-adds and nothing else.
+static inline void convolve_span_fixed(image im, image filter, int c0, int c1, int x, int y, int n, float *acc, const int K)
+{
+    int plane = im.w * im.h;
+    int r = K / 2;
+    for (int c = c0; c < c1; c++)
+    {
+        int fc = filter.c > 1 ? c : 0;
+        const float *f = filter.data + fc * K * K;
+        const float *rows[5];
+        vfloat weights[25];
+        for (int fy = 0; fy < K; fy++)
+            rows[fy] = im.data + c * plane + (y + fy - r) * im.w + x - r;
+        for (int i = 0; i < K * K; i++)
+            weights[i] = vset1(f[i]);
+
+        int i = 0;
+        for (; i + VLEN <= n; i += VLEN)
+        {
+            vfloat sum = vload(acc + i);
+            for (int fx = 0; fx < K; fx++)
+                for (int fy = 0; fy < K; fy++)
+                    sum = vadd(sum, vmul(vload(rows[fy] + i + fx), weights[fx + fy * K]));
+            vstore(acc + i, sum);
+        }
+        for (; i < n; i++)
+        {
+            float sum = acc[i];
+            for (int fx = 0; fx < K; fx++)
+                for (int fy = 0; fy < K; fy++)
+                    sum += rows[fy][i + fx] * f[fx + fy * K];
+            acc[i] = sum;
+        }
+    }
+}
+
+void convolve_span_3x3(image im, image filter, int c0, int c1, int x, int y, int n, float *acc)
+{
+    convolve_span_fixed(im, filter, c0, c1, x, y, n, acc, 3);
+}
+
+void convolve_span_5x5(image im, image filter, int c0, int c1, int x, int y, int n, float *acc)
+{
+    convolve_span_fixed(im, filter, c0, c1, x, y, n, acc, 5);
+}
+
+// Arguments of the direct path of convolve_image for parallel_for.
+typedef struct{
+    image im;
+    image filter;
+    image convolved;
+    void (*span)(image, image, int, int, int, int, int, float *);
+} conv_job;
+
+// Bands b0 .. b1 - 1 of CONV_TILE_H output rows of convolve_image.
+void convolve_image_bands(void *ctx, int b0, int b1)
+{
+    conv_job *job = ctx;
+    image im = job->im;
+    image filter = job->filter;
+    image convolved = job->convolved;
+    int numOfChannel = convolved.c;
+
+    // output pixels whose whole window lies inside the image
+    // don't need clamping: x0 <= x < x1 and y0 <= y < y1
+    int x0 = filter.w / 2;
+    int x1 = im.w - filter.w + filter.w / 2 + 1;
+    int y0 = filter.h / 2;
+    int y1 = im.h - filter.h + filter.h / 2 + 1;
+
+    float acc[CONV_TILE_W];
+
+    // walk the output in row-major tiles so the input rows a tile
+    // touches stay in cache while every row of the tile is computed
+    for (int ty = b0 * CONV_TILE_H; ty < MIN(b1 * CONV_TILE_H, im.h); ty += CONV_TILE_H)
+    {
+        for (int tx = 0; tx < im.w; tx += CONV_TILE_W)
+        {
+            int th = MIN(CONV_TILE_H, im.h - ty);
+            int tw = MIN(CONV_TILE_W, im.w - tx);
+
+            // the part of this tile that is interior in x
+            int ix0 = MAX(tx, x0);
+            int ix1 = MIN(tx + tw, x1);
+
+            for (int h = ty; h < ty + th; h++)
+            {
+                for (int k = 0; k < numOfChannel; k++)
+                {
+                    // with one output channel every input channel sums into it
+                    int c0 = numOfChannel > 1 ? k : 0;
+                    int c1 = numOfChannel > 1 ? k + 1 : im.c;
+                    float *out = convolved.data + k * im.w * im.h + h * im.w;
+
+                    if (h < y0 || h >= y1 || ix0 >= ix1)
+                    {
+                        for (int w = tx; w < tx + tw; w++)
+                            out[w] = convolve_pixel_clamped(im, filter, c0, c1, w, h);
+                        continue;
+                    }
+
+                    for (int w = tx; w < ix0; w++)
+                        out[w] = convolve_pixel_clamped(im, filter, c0, c1, w, h);
+
+                    int n = ix1 - ix0;
+                    for (int i = 0; i < n; i++)
+                        acc[i] = 0;
+                    job->span(im, filter, c0, c1, ix0, h, n, acc);
+                    for (int i = 0; i < n; i++)
+                        out[ix0 + i] = acc[i];
+
+                    for (int w = ix1; w < tx + tw; w++)
+                        out[w] = convolve_pixel_clamped(im, filter, c0, c1, w, h);
+                }
+            }
+        }
+    }
+}
+
 image convolve_image(image im, image filter, int preserve)
 {
     // Note that filter's size can'n be even, i.e 1x1, 3x3, 5x5 etc
     // filter better have either the same number of channels as im or have 1 channel
     assert(im.c == filter.c || filter.c == 1);
+    // the paths below index planes directly
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        image out = convolve_image(planar, filter, preserve);
+        free_image(planar);
+        set_layout(&out, im.layout);
+        return out;
+    }
+
+    // large constant filters cost the same at any size with summed area tables
+    if (filter.c == 1 && filter.w * filter.h >= BOX_SAT_MIN && constant_filter(filter))
+        return convolve_box(im, filter.w, filter.h, filter.data[0], preserve);
+
+    // 3x3 and 5x5 filters have their own unrolled kernels, which beat
+    // two 1d passes at that size. Larger rank 1 filters (gaussian, box)
+    // run as two 1d passes.
+    int fixed = (filter.w == 3 && filter.h == 3) || (filter.w == 5 && filter.h == 5);
+    image row, col;
+    if (!fixed && filter.w > 1 && filter.h > 1 && separate_filter(filter, &row, &col))
+    {
+        image convolved = convolve_separable(im, row, col, preserve);
+        free_image(row);
+        free_image(col);
+        return convolved;
+    }
+
+    // large filters that don't split go to the frequency domain
+    // when the cost model says the transforms are cheaper
+    if (filter.w * filter.h >= FFT_MIN_TAPS && fft_convolution_cheaper(im, filter, preserve))
+        return convolve_fft(im, filter, preserve);
 
     // 3 cases:
     // 1. filter and im have the same number of channels
@@ -72,65 +488,430 @@ image convolve_image(image im, image filter, int preserve)
             numOfChannel = 3;
         }
     }
-    image convolved = make_image(im.w, im.h, numOfChannel);
+    conv_job job;
+    job.im = im;
+    job.filter = filter;
+    job.convolved = make_image(im.w, im.h, numOfChannel);
+    job.span = convolve_span_interior;
+    if (filter.w == 3 && filter.h == 3)
+        job.span = convolve_span_3x3;
+    else if (filter.w == 5 && filter.h == 5)
+        job.span = convolve_span_5x5;
+
+    // bands of tile rows are independent, one band is a parallel item
+    int bands = (im.h + CONV_TILE_H - 1) / CONV_TILE_H;
+    double cost = (double)CONV_TILE_H * im.w * filter.w * filter.h * im.c;
+    parallel_for(bands, parallel_grain(cost), convolve_image_bands, &job);
+    return job.convolved;
+}
 
-    float sum, x_im, y_im, filter_pixel, im_pixel;
+// Arguments of convolve_view for parallel_for.
+typedef struct{
+    image_view im;
+    image filter;
+    image_view out;
+} view_conv_job;
 
-    // loop over every pixel in image
-    for (int w = 0; w < im.w; w++)
+// Output rows y0 .. y1 - 1 of convolve_view.
+void convolve_view_rows(void *ctx, int y0, int y1)
+{
+    view_conv_job *job = ctx;
+    image_view im = job->im;
+    image filter = job->filter;
+    image_view out = job->out;
+    int xs = im.xstride;
+    int rx = filter.w / 2;
+    int ry = filter.h / 2;
+
+    // columns whose window is inside the view in x
+    int x0 = MIN(rx, im.w);
+    int x1 = MAX(x0, im.w - filter.w + rx + 1);
+    float *acc = calloc(im.w, sizeof(float));
+    for (int y = y0; y < y1; y++)
     {
-        for (int h = 0; h < im.h; h++)
+        for (int k = 0; k < out.c; k++)
         {
-            sum = 0;
-            for (int c = 0; c < im.c; c++)
+            int c0 = out.c > 1 ? k : 0;
+            int c1 = out.c > 1 ? k + 1 : im.c;
+            memset(acc, 0, im.w * sizeof(float));
+            for (int c = c0; c < c1; c++)
             {
-                // set sum to zero when starting to convolve over different channel
-                if (numOfChannel > 1)
+                int fc = filter.c > 1 ? c : 0;
+                const float *f = filter.data + fc * filter.w * filter.h;
+                for (int fx = 0; fx < filter.w; fx++)
                 {
-                    sum = 0;
-                }
-
-                // loop over the filter pixels and apply filter to pixel in the center
-                for (int filter_w = 0; filter_w < filter.w; filter_w++)
-                {
-                    // to apply to pixel in the center of filter
-                    x_im = w + filter_w - filter.w / 2;
-                    for (int filter_h = 0; filter_h < filter.h; filter_h++)
+                    for (int fy = 0; fy < filter.h; fy++)
                     {
-                        // to apply to pixel in the center of filter
-                        y_im = h + filter_h - filter.h / 2;
-
-                        // get the center pixel value of the image
-                        im_pixel = get_pixel(im, x_im, y_im, c);
-
-                        // get the center pixel value of the filter
-                        if (filter.c > 1)
+                        const float *row = view_at(im, 0, clamp_padding(y + fy - ry, 0, im.h), c);
+                        float tap = f[fx + fy * filter.w];
+                        for (int x = 0; x < x0; x++)
+                            acc[x] += row[clamp_padding(x + fx - rx, 0, im.w) * xs] * tap;
+                        const float *in = row + (fx - rx) * xs;
+                        if (xs == 1)
                         {
-                            filter_pixel = get_pixel(filter, filter_w, filter_h, c);
+                            for (int x = x0; x < x1; x++)
+                                acc[x] += in[x] * tap;
                         }
                         else
                         {
-                            filter_pixel = get_pixel(filter, filter_w, filter_h, 0);
+                            for (int x = x0; x < x1; x++)
+                                acc[x] += in[x * xs] * tap;
                         }
-                        // get the weighted sum over all values resulting from
-                        // convulving the certain pixel with the kernel
-                        sum += im_pixel * filter_pixel;
+                        for (int x = x1; x < im.w; x++)
+                            acc[x] += row[clamp_padding(x + fx - rx, 0, im.w) * xs] * tap;
                     }
                 }
-                // set pixel to new value
-                if (numOfChannel > 1)
-                {
-                    set_pixel(convolved, w, h, c, sum);
-                }
             }
+            float *o = view_at(out, 0, y, k);
+            for (int x = 0; x < im.w; x++)
+                o[x * out.xstride] = acc[x];
+        }
+    }
+    free(acc);
+}
+
+// Convolves a view into another, e.g. a tile or region of interest of
+// a larger image, without copying either. Same as convolve_image on a
+// copy of the view: padding clamps to the view's own border, taps are
+// summed in the same order as the direct path.
+// image_view im: view to convolve.
+// image filter: filter with 1 or im.c channels.
+// int preserve: whether to keep the channels of im or sum them into one.
+// image_view out: im.w x im.h view, im.c or 1 channels, not overlapping im.
+void convolve_view(image_view im, image filter, int preserve, image_view out)
+{
+    assert(im.c == filter.c || filter.c == 1);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve == 1 ? im.c : 1));
+    view_conv_job job = {im, filter, out};
+    double cost = (double)im.w * filter.w * filter.h * im.c;
+    parallel_for(im.h, parallel_grain(cost), convolve_view_rows, &job);
+}
 
-            if (numOfChannel == 1)
+// Arguments of convolve_filter_bank for parallel_for.
+typedef struct{
+    image im;
+    image *filters;
+    int n;
+    image bank;
+} bank_job;
+
+// Bands b0 .. b1 - 1 of CONV_TILE_H output rows of convolve_filter_bank.
+void convolve_filter_bank_bands(void *ctx, int b0, int b1)
+{
+    bank_job *job = ctx;
+    image im = job->im;
+    image *filters = job->filters;
+    image bank = job->bank;
+    int n = job->n;
+    int fw = filters[0].w;
+    int fh = filters[0].h;
+    int plane = im.w * im.h;
+
+    int x0 = fw / 2;
+    int x1 = im.w - fw + fw / 2 + 1;
+    int y0 = fh / 2;
+    int y1 = im.h - fh + fh / 2 + 1;
+    float *acc = calloc((size_t)n * CONV_TILE_W, sizeof(float));
+
+    for (int ty = b0 * CONV_TILE_H; ty < MIN(b1 * CONV_TILE_H, im.h); ty += CONV_TILE_H)
+    {
+        for (int tx = 0; tx < im.w; tx += CONV_TILE_W)
+        {
+            int th = MIN(CONV_TILE_H, im.h - ty);
+            int tw = MIN(CONV_TILE_W, im.w - tx);
+            int ix0 = MAX(tx, x0);
+            int ix1 = MIN(tx + tw, x1);
+
+            for (int h = ty; h < ty + th; h++)
             {
-                set_pixel(convolved, w, h, 0, sum);
+                int interior = h >= y0 && h < y1 && ix0 < ix1;
+                for (int k = 0; k < n; k++)
+                {
+                    float *out = bank.data + k * plane + h * im.w;
+                    for (int w = tx; w < tx + tw; w++)
+                    {
+                        if (!interior || w < ix0 || w >= ix1)
+                            out[w] = convolve_pixel_clamped(im, filters[k], 0, im.c, w, h);
+                    }
+                }
+                if (!interior)
+                    continue;
+
+                int count = ix1 - ix0;
+                memset(acc, 0, (size_t)n * CONV_TILE_W * sizeof(float));
+                for (int c = 0; c < im.c; c++)
+                {
+                    for (int filter_w = 0; filter_w < fw; filter_w++)
+                    {
+                        int x_im = ix0 + filter_w - fw / 2;
+                        for (int filter_h = 0; filter_h < fh; filter_h++)
+                        {
+                            int y_im = h + filter_h - fh / 2;
+                            const float *in = im.data + c * plane + y_im * im.w + x_im;
+                            for (int k = 0; k < n; k++)
+                            {
+                                int fc = filters[k].c > 1 ? c : 0;
+                                float tap = filters[k].data[filter_w + filter_h * fw + fc * fw * fh];
+                                float *a = acc + k * CONV_TILE_W;
+                                for (int i = 0; i < count; i++)
+                                    a[i] += in[i] * tap;
+                            }
+                        }
+                    }
+                }
+                for (int k = 0; k < n; k++)
+                    memcpy(bank.data + k * plane + h * im.w + ix0, acc + k * CONV_TILE_W, count * sizeof(float));
             }
         }
     }
-    return convolved;
+    free(acc);
+}
+
+// Convolves an image with a bank of filters in a single pass over it.
+// Output plane k is convolve_image(im, filters[k], 0). For every tap
+// position the input span is loaded once and feeds all n accumulators,
+// so the image is streamed from memory once however many filters there
+// are, e.g. a gx / gy pair or an oriented texture bank.
+// image im: image to convolve.
+// image *filters: n filters of the same size, each with 1 or im.c channels.
+// int n: number of filters.
+// returns: image with n channels, one per filter.
+image convolve_filter_bank(image im, image *filters, int n)
+{
+    for (int k = 0; k < n; k++)
+    {
+        assert(filters[k].w == filters[0].w && filters[k].h == filters[0].h);
+        assert(filters[k].c == im.c || filters[k].c == 1);
+    }
+    // the paths below index planes directly
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        image out = convolve_filter_bank(planar, filters, n);
+        free_image(planar);
+        set_layout(&out, im.layout);
+        return out;
+    }
+    bank_job job = {im, filters, n, make_image(im.w, im.h, n)};
+    int bands = (im.h + CONV_TILE_H - 1) / CONV_TILE_H;
+    double cost = (double)CONV_TILE_H * im.w * filters[0].w * filters[0].h * im.c * n;
+    parallel_for(bands, parallel_grain(cost), convolve_filter_bank_bands, &job);
+    return job.bank;
+}
+
+// Coefficients of the Young - van Vliet recursive gaussian.
+// float sigma: std dev. of the gaussian, 0.5 or more.
+// float *a: filled with the 3 feedback coefficients a1, a2, a3.
+// returns: the feedforward gain B, so that w[n] = B x[n] + sum a_i w[n - i].
+float recursive_gaussian_coefficients(float sigma, float *a)
+{
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                            : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    double b3 = 0.422205 * q * q * q;
+    a[0] = b1 / b0;
+    a[1] = b2 / b0;
+    a[2] = b3 / b0;
+    return 1 - (a[0] + a[1] + a[2]);
+}
+
+// Right / bottom boundary of the recursive gaussian (Triggs and Sdika
+// 2006). Past the last sample the clamped input is constant, u, and the
+// anti-causal pass has to start from what it would have reached coming
+// back from infinity. That start is u plus a linear map of how far the
+// last three causal outputs are from u. The map is found here by running
+// the two recursions on each unit deviation until they have died out.
+// float B, *a: coefficients from recursive_gaussian_coefficients.
+// float *m: filled with the 3x3 map, row-major.
+void recursive_gaussian_boundary(float sigma, float B, const float *a, float *m)
+{
+    int n = 20 * sigma + 64;
+    double *w = calloc(n, sizeof(double));
+    for (int i = 0; i < 3; i++)
+    {
+        // causal pass on zero input from the state (w[N-1], w[N-2], w[N-3]) = e_i
+        double p[3] = {0, 0, 0};
+        p[i] = 1;
+        for (int k = 0; k < n; k++)
+        {
+            w[k] = a[0] * p[0] + a[1] * p[1] + a[2] * p[2];
+            p[2] = p[1];
+            p[1] = p[0];
+            p[0] = w[k];
+        }
+
+        // anti-causal pass back from where everything has decayed to 0
+        p[0] = p[1] = p[2] = 0;
+        for (int k = n - 1; k >= 0; k--)
+        {
+            double v = B * w[k] + a[0] * p[0] + a[1] * p[1] + a[2] * p[2];
+            p[2] = p[1];
+            p[1] = p[0];
+            p[0] = v;
+            if (k < 3)
+                m[k * 3 + i] = v;
+        }
+    }
+    free(w);
+}
+
+// Arguments of recursive_gaussian_rows / recursive_gaussian_cols for parallel_for.
+typedef struct{
+    float *data;
+    int w, h;
+    float B;
+    const float *a;
+    const float *m;
+} iir_job;
+
+// Rows y0 .. y1 - 1 of recursive_gaussian_rows.
+void recursive_gaussian_row_band(void *ctx, int y0, int y1)
+{
+    iir_job *job = ctx;
+    float *data = job->data;
+    int w = job->w;
+    float B = job->B;
+    const float *a = job->a;
+    const float *m = job->m;
+    for (int y = y0; y < y1; y++)
+    {
+        float *row = data + y * w;
+        float u = row[w - 1];
+
+        // a clamped edge is at its steady state, where output equals input
+        float w1 = row[0], w2 = row[0], w3 = row[0];
+        for (int x = 0; x < w; x++)
+        {
+            float v = B * row[x] + a[0] * w1 + a[1] * w2 + a[2] * w3;
+            w3 = w2;
+            w2 = w1;
+            w1 = v;
+            row[x] = v;
+        }
+
+        float d[3] = {w1 - u, w2 - u, w3 - u};
+        w1 = u + m[0] * d[0] + m[1] * d[1] + m[2] * d[2];
+        w2 = u + m[3] * d[0] + m[4] * d[1] + m[5] * d[2];
+        w3 = u + m[6] * d[0] + m[7] * d[1] + m[8] * d[2];
+        for (int x = w - 1; x >= 0; x--)
+        {
+            float v = B * row[x] + a[0] * w1 + a[1] * w2 + a[2] * w3;
+            w3 = w2;
+            w2 = w1;
+            w1 = v;
+            row[x] = v;
+        }
+    }
+}
+
+// Runs the causal then anti-causal recursion along every row of a plane, in place.
+// float *m: right boundary map from recursive_gaussian_boundary.
+void recursive_gaussian_rows(float *data, int w, int h, float B, const float *a, const float *m)
+{
+    iir_job job = {data, w, h, B, a, m};
+    parallel_for(h, parallel_grain(12. * w), recursive_gaussian_row_band, &job);
+}
+
+// Runs the causal then anti-causal recursion down columns 0 .. w - 1 of
+// a plane with rows stride floats apart, in place. Each step updates a
+// whole row, so the inner loop is contiguous.
+// float *m: bottom boundary map from recursive_gaussian_boundary.
+void recursive_gaussian_strip(float *data, int w, int h, int stride, float B, const float *a, const float *m)
+{
+    // the last input row and the three rows the backward pass starts from
+    float *tail = calloc(4 * w, sizeof(float));
+    float *u = tail + 3 * w;
+    memcpy(u, data + (h - 1) * stride, w * sizeof(float));
+
+    // prev[0..2] are the rows one, two and three steps back. Before the
+    // first row they are the first row itself: a clamped edge is at its
+    // steady state, where output equals input.
+    const float *prev[3];
+    for (int i = 0; i < 3; i++)
+        prev[i] = data;
+    for (int y = 0; y < h; y++)
+    {
+        float *row = data + y * stride;
+        for (int x = 0; x < w; x++)
+            row[x] = B * row[x] + a[0] * prev[0][x] + a[1] * prev[1][x] + a[2] * prev[2][x];
+        prev[2] = prev[1];
+        prev[1] = prev[0];
+        prev[0] = row;
+    }
+
+    for (int k = 0; k < 3; k++)
+    {
+        float *start = tail + k * w;
+        for (int x = 0; x < w; x++)
+        {
+            start[x] = u[x] + m[k * 3] * (prev[0][x] - u[x]) + m[k * 3 + 1] * (prev[1][x] - u[x]) + m[k * 3 + 2] * (prev[2][x] - u[x]);
+        }
+    }
+    for (int i = 0; i < 3; i++)
+        prev[i] = tail + i * w;
+    for (int y = h - 1; y >= 0; y--)
+    {
+        float *row = data + y * stride;
+        for (int x = 0; x < w; x++)
+            row[x] = B * row[x] + a[0] * prev[0][x] + a[1] * prev[1][x] + a[2] * prev[2][x];
+        prev[2] = prev[1];
+        prev[1] = prev[0];
+        prev[0] = row;
+    }
+    free(tail);
+}
+
+// Strips of columns x0 .. x1 - 1 of recursive_gaussian_cols.
+void recursive_gaussian_col_strip(void *ctx, int x0, int x1)
+{
+    iir_job *job = ctx;
+    recursive_gaussian_strip(job->data + x0, x1 - x0, job->h, job->w, job->B, job->a, job->m);
+}
+
+// Runs the causal then anti-causal recursion down every column of a plane, in place.
+// Columns are independent, so strips of them run in parallel.
+// float *m: bottom boundary map from recursive_gaussian_boundary.
+void recursive_gaussian_cols(float *data, int w, int h, float B, const float *a, const float *m)
+{
+    iir_job job = {data, w, h, B, a, m};
+    parallel_for(w, MAX(64, parallel_grain(12. * h)), recursive_gaussian_col_strip, &job);
+}
+
+// Smooths an image with a recursive (IIR) approximation of a gaussian,
+// Young and van Vliet 1995. Each pass is a 3rd order recursion, so the
+// cost per pixel does not depend on sigma. Edges are clamped like
+// convolve_image, both ends exactly. Against the FIR gaussian of
+// make_1d_gaussian the result differs by at most 1.5% of the image range
+// for sigma >= 8 (1% for sigma >= 12), 0.2% on average.
+// image im: image to smooth.
+// float sigma: std dev. for Gaussian, 0.5 or more.
+// returns: smoothed image with the same channels as im.
+image recursive_gaussian(image im, float sigma)
+{
+    assert(sigma >= 0.5);
+    // the paths below index planes directly
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        image out = recursive_gaussian(planar, sigma);
+        free_image(planar);
+        set_layout(&out, im.layout);
+        return out;
+    }
+    float a[3], m[9];
+    float B = recursive_gaussian_coefficients(sigma, a);
+    recursive_gaussian_boundary(sigma, B, a, m);
+
+    image smoothed = copy_image(im);
+    for (int c = 0; c < im.c; c++)
+    {
+        float *plane = smoothed.data + c * im.w * im.h;
+        recursive_gaussian_rows(plane, im.w, im.h, B, a, m);
+        recursive_gaussian_cols(plane, im.w, im.h, B, a, m);
+    }
+    return smoothed;
 }
 
 image make_highpass_filter()
@@ -226,30 +1007,76 @@ image make_gaussian_filter(float sigma)
     return kernel;
 }
 
+// Arguments of add_view / sub_view for parallel_for.
+typedef struct{
+    image_view a, b;
+    image_view out;
+    float sign;
+} pointwise_job;
+
+// Rows r0 .. r1 - 1 of add_view / sub_view, channels stacked.
+void add_rows(void *ctx, int r0, int r1)
+{
+    pointwise_job *job = ctx;
+    image_view a = job->a, b = job->b, out = job->out;
+    float sign = job->sign;
+    for (int r = r0; r < r1; r++)
+    {
+        int c = r / out.h;
+        int y = r % out.h;
+        const float *pa = view_at(a, 0, y, c);
+        const float *pb = view_at(b, 0, y, c);
+        float *po = view_at(out, 0, y, c);
+        if (a.xstride == 1 && b.xstride == 1 && out.xstride == 1)
+        {
+            for (int x = 0; x < out.w; x++)
+                po[x] = pa[x] + sign * pb[x];
+        }
+        else
+        {
+            for (int x = 0; x < out.w; x++)
+                po[x * out.xstride] = pa[x * a.xstride] + sign * pb[x * b.xstride];
+        }
+    }
+}
+
+// out = a + b, pixel by pixel. All three views have the same size,
+// out may be a or b.
+void add_view(image_view a, image_view b, image_view out)
+{
+    assert(a.w == b.w && a.h == b.h && a.c == b.c);
+    assert(a.w == out.w && a.h == out.h && a.c == out.c);
+    pointwise_job job = {a, b, out, 1};
+    parallel_for(out.h * out.c, parallel_grain(out.w), add_rows, &job);
+}
+
+// out = a - b, pixel by pixel, as add_view.
+void sub_view(image_view a, image_view b, image_view out)
+{
+    assert(a.w == b.w && a.h == b.h && a.c == b.c);
+    assert(a.w == out.w && a.h == out.h && a.c == out.c);
+    pointwise_job job = {a, b, out, -1};
+    parallel_for(out.h * out.c, parallel_grain(out.w), add_rows, &job);
+}
+
 image add_image(image a, image b)
 {
     // check that the two images have the same size
     assert(a.w == b.w && a.h == b.h && a.c == b.c);
 
-    // make the new hybrid image
-    image im = make_image(a.w, a.h, a.c);
+    // make the new hybrid image, b can be in either layout
+    image im = make_image_layout(a.w, a.h, a.c, a.layout);
 
     // sum
-    for (int i = 0; i < im.w * im.h * im.c; i++)
-    {
-        im.data[i] = a.data[i] + b.data[i];
-    }
+    add_view(view_image(a), view_image(b), view_image(im));
     return im;
 }
 
 image sub_image(image a, image b)
 {
     assert(a.w == b.w && a.h == b.h && a.c == b.c);
-    image im = make_image(a.w, a.h, a.c);
-    for (int i = 0; i < im.w * im.h * im.c; i++)
-    {
-        im.data[i] = a.data[i] - b.data[i];
-    }
+    image im = make_image_layout(a.w, a.h, a.c, a.layout);
+    sub_view(view_image(a), view_image(b), view_image(im));
     return im;
 }
 
@@ -285,43 +1112,271 @@ image make_gy_filter()
     return sobel_filter;
 }
 
+// Arguments of feature_normalize for parallel_for.
+typedef struct{
+    float *data;
+    int n;
+    float *mini, *maxi;   // one per chunk
+    float lo, range;
+} normalize_job;
+
+// Min and max of each chunk of PARALLEL_MIN_WORK values.
+void feature_range_chunks(void *ctx, int k0, int k1)
+{
+    normalize_job *job = ctx;
+    for (int k = k0; k < k1; k++)
+    {
+        float maxi = -INFINITY;
+        float mini = +INFINITY;
+        int start = k * PARALLEL_MIN_WORK;
+        for (int i = start; i < start + PARALLEL_MIN_WORK && i < job->n; i++)
+        {
+            maxi = fmax(job->data[i], maxi);
+            mini = fmin(job->data[i], mini);
+        }
+        job->maxi[k] = maxi;
+        job->mini[k] = mini;
+    }
+}
+
+void feature_normalize_range(void *ctx, int start, int end)
+{
+    normalize_job *job = ctx;
+    for (int i = start; i < end; i++)
+    {
+        // avoid zero division
+        job->data[i] = job->range != 0. ? (job->data[i] - job->lo) / job->range : 0;
+    }
+}
+
 void feature_normalize(image im)
 {
-    // for comparison
+    if (image_floats(im) != (size_t)im.w * im.h * im.c)
+    {
+        // padding isn't pixels, work on a packed copy
+        image packed = to_layout(im, im.layout);
+        feature_normalize(packed);
+        copy_to_view(view_image(packed), view_image(im));
+        free_image(packed);
+        return;
+    }
+    int n = im.w * im.h * im.c;
+    int chunks = (n + PARALLEL_MIN_WORK - 1) / PARALLEL_MIN_WORK;
+    normalize_job job = {im.data, n, calloc(chunks, sizeof(float)), calloc(chunks, sizeof(float)), 0, 0};
+
+    // find max and min, per chunk and then over the chunks
+    parallel_for(chunks, 1, feature_range_chunks, &job);
     float maxi = -INFINITY;
     float mini = +INFINITY;
+    for (int k = 0; k < chunks; k++)
+    {
+        maxi = fmax(job.maxi[k], maxi);
+        mini = fmin(job.mini[k], mini);
+    }
+    free(job.mini);
+    free(job.maxi);
+
+    job.lo = mini;
+    job.range = maxi - mini;
+    parallel_for(n, PARALLEL_MIN_WORK, feature_normalize_range, &job);
+}
+
+// Arguments of threshold_image and threshold_image_u8 for parallel_for.
+typedef struct{
+    void *data;
+    float thresh;
+} threshold_job;
+
+void threshold_range(void *ctx, int start, int end)
+{
+    threshold_job *job = ctx;
+    float *data = job->data;
+    for (int i = start; i < end; i++)
+        data[i] = data[i] > job->thresh ? 1 : 0;
+}
+
+void threshold_range_u8(void *ctx, int start, int end)
+{
+    threshold_job *job = ctx;
+    unsigned char *data = job->data;
+    unsigned char thresh = job->thresh;
+    for (int i = start; i < end; i++)
+        data[i] = data[i] > thresh ? 255 : 0;
+}
+
+// Sets pixels above thresh to 1 and the rest to 0, in place.
+void threshold_image(image im, float thresh)
+{
+    threshold_job job = {im.data, thresh};
+    parallel_for(image_floats(im), PARALLEL_MIN_WORK, threshold_range, &job);
+}
+
+// threshold_image for 8 bit images: pixels above thresh become 255.
+void threshold_image_u8(image_u8 im, unsigned char thresh)
+{
+    threshold_job job = {im.data, thresh};
+    parallel_for(im.w * im.h * im.c, PARALLEL_MIN_WORK, threshold_range_u8, &job);
+}
 
-    // find max and min
-    for (int i = 0; i < im.w * im.h * im.c; i++)
+// Computes the sobel response of the pixels (x, y) .. (x + n - 1, y).
+// Channels are summed, as in convolve_image(im, make_gx_filter(), 0).
+// Rows are clamped once up front, so only the first and last column of
+// the image need the clamped path.
+// float *gx, *gy: n outputs each.
+void sobel_span(image im, int x, int y, int n, float *gx, float *gy)
+{
+    int plane = im.w * im.h;
+    for (int i = 0; i < n; i++)
     {
-        maxi = fmax(im.data[i], maxi);
-        mini = fmin(im.data[i], mini);
+        gx[i] = 0;
+        gy[i] = 0;
+    }
+    for (int c = 0; c < im.c; c++)
+    {
+        const float *base = im.data + c * plane;
+        const float *r0 = base + clamp_padding(y - 1, 0, im.h) * im.w;
+        const float *r1 = base + y * im.w;
+        const float *r2 = base + clamp_padding(y + 1, 0, im.h) * im.w;
+
+        int i0 = x == 0 ? 1 : 0;
+        int i1 = x + n == im.w ? n - 1 : n;
+        for (int i = 0; i < n; i++)
+        {
+            if (i >= i0 && i < i1)
+                continue;
+            int l = clamp_padding(x + i - 1, 0, im.w);
+            int r = clamp_padding(x + i + 1, 0, im.w);
+            int m = x + i;
+            gx[i] += (r0[r] - r0[l]) + 2 * (r1[r] - r1[l]) + (r2[r] - r2[l]);
+            gy[i] += (r2[l] - r0[l]) + 2 * (r2[m] - r0[m]) + (r2[r] - r0[r]);
+        }
+        for (int i = i0; i < i1; i++)
+        {
+            int m = x + i;
+            gx[i] += (r0[m + 1] - r0[m - 1]) + 2 * (r1[m + 1] - r1[m - 1]) + (r2[m + 1] - r2[m - 1]);
+            gy[i] += (r2[m - 1] - r0[m - 1]) + 2 * (r2[m] - r0[m]) + (r2[m + 1] - r0[m + 1]);
+        }
     }
+}
 
-    float range = maxi - mini;
-    float normalizing_pixel;
-    for (int w = 0; w < im.w; w++)
+// atan(z) for 0 <= z <= 1 as an odd minimax polynomial.
+static inline float atan_poly(float z)
+{
+    float z2 = z * z;
+    return z * (0.99997726f + z2 * (-0.33262347f + z2 * (0.19354346f + z2 * (-0.11643287f + z2 * (0.05265332f + z2 * -0.01172120f)))));
+}
+
+// Branchless atan2. Reduces to an octant with min / max, evaluates
+// atan_poly there and reflects back with selects, so loops over it
+// vectorize. Max error 2e-6 rad (1.2e-4 degrees), atan2(0, 0) = 0.
+static inline float fast_atan2f(float y, float x)
+{
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    float maxi = MAX(ax, ay);
+    float mini = MIN(ax, ay);
+    float a = atan_poly(maxi > 0 ? mini / maxi : 0);
+    a = ay > ax ? 1.57079633f - a : a;
+    a = x < 0 ? 3.14159265f - a : a;
+    return copysignf(a, y);
+}
+
+// 1 / sqrt(s) from the exponent bit trick plus two Newton steps.
+// Max relative error 5e-6 for s > 0.
+static inline float fast_rsqrtf(float s)
+{
+    union
     {
-        for (int h = 0; h < im.h; h++)
+        float f;
+        unsigned int i;
+    } u = {s};
+    u.i = 0x5f375a86 - (u.i >> 1);
+    float r = u.f;
+    r = r * (1.5f - 0.5f * s * r * r);
+    r = r * (1.5f - 0.5f * s * r * r);
+    return r;
+}
+
+// Arguments of sobel_gradient for parallel_for.
+typedef struct{
+    image im;
+    image gx, gy, mag, dir;
+    int fast;
+} sobel_job;
+
+// Rows y0 .. y1 - 1 of sobel_gradient.
+void sobel_gradient_rows(void *ctx, int y0, int y1)
+{
+    sobel_job *job = ctx;
+    image im = job->im;
+    image gx = job->gx, gy = job->gy, mag = job->mag, dir = job->dir;
+    int fast = job->fast;
+    float bx[CONV_TILE_W];
+    float by[CONV_TILE_W];
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = 0; x < im.w; x += CONV_TILE_W)
         {
-            for (int c = 0; c < im.c; c++)
+            int n = MIN(CONV_TILE_W, im.w - x);
+            int index = x + y * im.w;
+            sobel_span(im, x, y, n, bx, by);
+            if (gx.data)
+                memcpy(gx.data + index, bx, n * sizeof(float));
+            if (gy.data)
+                memcpy(gy.data + index, by, n * sizeof(float));
+            if (mag.data && fast)
             {
-                float pixel = get_pixel(im, w, h, c);
-                if (range != 0.)
-                {
-                    normalizing_pixel = (pixel - mini) / range;
-                }
-                else
+                for (int i = 0; i < n; i++)
                 {
-                    // avoid zero division
-                    normalizing_pixel = 0;
+                    float s = bx[i] * bx[i] + by[i] * by[i];
+                    mag.data[index + i] = s > 0 ? s * fast_rsqrtf(s) : 0;
                 }
-                set_pixel(im, w, h, c, normalizing_pixel);
+            }
+            else if (mag.data)
+            {
+                for (int i = 0; i < n; i++)
+                    mag.data[index + i] = sqrtf(bx[i] * bx[i] + by[i] * by[i]);
+            }
+            if (dir.data && fast)
+            {
+                for (int i = 0; i < n; i++)
+                    dir.data[index + i] = fast_atan2f(by[i], bx[i]);
+            }
+            else if (dir.data)
+            {
+                for (int i = 0; i < n; i++)
+                    dir.data[index + i] = atan2f(by[i], bx[i]);
             }
         }
     }
 }
 
+// Fused sobel operator. Computes the x and y derivatives, gradient
+// magnitude and gradient direction in a single sweep over the image and
+// writes them straight into the given 1 channel, im.w x im.h planes.
+// Pass an image with no data, e.g. (image){0}, for any output you don't
+// need and it won't be computed.
+// image im: input image, channels are summed.
+// image gx, gy: sobel x and y responses.
+// image mag: gradient magnitude.
+// image dir: gradient direction, atan2(gy, gx).
+// int precision: GRADIENT_EXACT uses libm sqrt and atan2. GRADIENT_FAST
+//                uses polynomial approximations: magnitude within 5e-6
+//                relative, direction within 2e-6 rad.
+void sobel_gradient(image im, image gx, image gy, image mag, image dir, int precision)
+{
+    // sobel_span reads planes, the outputs are 1 channel either way
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        sobel_gradient(planar, gx, gy, mag, dir, precision);
+        free_image(planar);
+        return;
+    }
+    sobel_job job = {im, gx, gy, mag, dir, precision == GRADIENT_FAST};
+    parallel_for(im.h, parallel_grain(20. * im.w * im.c), sobel_gradient_rows, &job);
+}
+
 image *sobel_image(image im)
 {
     /*!
@@ -333,52 +1388,31 @@ image *sobel_image(image im)
     mag_and_direct[0] = make_image(im.w, im.h, 1);
     mag_and_direct[1] = make_image(im.w, im.h, 1);
 
-    // make the filters
-    image sobel_gx = convolve_image(im, make_gx_filter(), 0);
-    image sobel_gy = convolve_image(im, make_gy_filter(), 0);
-
-    for (int w = 0; w < im.w; w++)
-    {
-        for (int h = 0; h < im.h; h++)
-        {
-            for (int c = 0; c < 1; c++)
-            {
-                float x = get_pixel(sobel_gx, w, h, c);
-                float y = get_pixel(sobel_gy, w, h, c);
-
-                // magnitude
-                set_pixel(mag_and_direct[0], w, h, 0, sqrt(x * x + y * y));
-
-                // direction
-                set_pixel(mag_and_direct[1], w, h, 0, atan2(y, x));
-            }
-        }
-    }
+    // gx and gy are only needed on the way, so don't keep them
+    image none = {0};
+    sobel_gradient(im, none, none, mag_and_direct[0], mag_and_direct[1], GRADIENT_EXACT);
     return mag_and_direct;
 }
 
 image colorize_sobel(image im)
 {
-    image *mag_and_direct = sobel_image(im);
-    image colorize_sobel = make_image(im.w, im.h, im.c);
-    feature_normalize(mag_and_direct[0]);
-    feature_normalize(mag_and_direct[1]);
-    float S, V, H;
-    for (int w = 0; w < im.w; w++)
-    {
-        for (int h = 0; h < im.h; h++)
-        {
-            // use the magnitude to specify the
-            // saturation and value of an image
-            // and the angle to specify the hue
-            S = get_pixel(mag_and_direct[0], w, h, 0);
-            V = get_pixel(mag_and_direct[0], w, h, 0);
-            H = get_pixel(mag_and_direct[1], w, h, 0);
-            set_pixel(colorize_sobel, w, h, 0, H);
-            set_pixel(colorize_sobel, w, h, 1, S);
-            set_pixel(colorize_sobel, w, h, 2, V);
-        }
-    }
+    image colorize_sobel = make_image(im.w, im.h, 3);
+
+    // use the magnitude to specify the saturation and value
+    // of an image and the angle to specify the hue.
+    // sobel_gradient writes straight into the H and S planes.
+    int plane = im.w * im.h;
+    image H = colorize_sobel;
+    image S = colorize_sobel;
+    H.c = S.c = 1;
+    S.data += plane;
+    image none = {0};
+    // both get normalized to [0, 1] for display, the fast path is plenty
+    sobel_gradient(im, none, none, S, H, GRADIENT_FAST);
+    feature_normalize(S);
+    feature_normalize(H);
+    memcpy(colorize_sobel.data + 2 * plane, S.data, plane * sizeof(float));
+
     hsv_to_rgb(colorize_sobel);
     return colorize_sobel;
 }
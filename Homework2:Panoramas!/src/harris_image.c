@@ -5,8 +5,12 @@
 #include <assert.h>
 #include "image.h"
 #include "matrix.h"
+#include "parallel.h"
 #include <time.h>
 
+// smooth_image switches to the recursive gaussian from this sigma up
+#define SMOOTH_IIR_SIGMA 8
+
 // Frees an array of descriptors.
 // descriptor *d: the array.
 // int n: number of elements in array.
@@ -39,7 +43,7 @@ descriptor describe_index(image im, int i)
     // to compensate some for exposure/lighting changes.
     for (c = 0; c < im.c; ++c)
     {
-        float cval = im.data[c * im.w * im.h + i];
+        float cval = get_pixel(im, i % im.w, i / im.w, c);
         for (dx = -w / 2; dx < (w + 1) / 2; ++dx)
         {
             for (dy = -w / 2; dy < (w + 1) / 2; ++dy)
@@ -89,8 +93,22 @@ void mark_corners(image im, descriptor *d, int n)
 // returns: single row image of the filter.
 image make_1d_gaussian(float sigma)
 {
-    // TODO: optional, make separable 1d Gaussian.
-    return make_image(1, 1, 1);
+    // same support as make_gaussian_filter: the next odd integer from 6x sigma
+    int size = ceil(sigma * 6);
+    size = size % 2 == 0 ? size + 1 : size;
+    int center = size / 2;
+
+    image kernel = make_image(size, 1, 1);
+    for (int x = 0; x < size; x++)
+    {
+        int sub_x = x - center;
+        kernel.data[x] = exp(-1 * (sub_x * sub_x) / (2 * sigma * sigma));
+    }
+
+    // the outer product of two of these sums to 1 if each one does
+    l1_normalize(kernel);
+
+    return kernel;
 }
 
 // Smooths an image using separable Gaussian filter.
@@ -99,18 +117,29 @@ image make_1d_gaussian(float sigma)
 // returns: smoothed image.
 image smooth_image(image im, float sigma)
 {
-    if (1)
-    {
-        image g = make_gaussian_filter(sigma);
-        image s = convolve_image(im, g, 1);
-        free_image(g);
-        return s;
-    }
-    else
+    // past this the recursive gaussian is cheaper than any FIR pass
+    if (sigma >= SMOOTH_IIR_SIGMA)
+        return recursive_gaussian(im, sigma);
+
+    // one horizontal and one vertical pass with the same 1d gaussian
+    image g = make_1d_gaussian(sigma);
+    image s = convolve_separable(im, g, g, 1);
+    free_image(g);
+    return s;
+}
+
+// Pixels start .. end - 1 of the Ix Iy products in structure_matrix.
+void structure_products(void *ctx, int start, int end)
+{
+    image S = *(image *)ctx;
+    int plane = S.w * S.h;
+    for (int i = start; i < end; i++)
     {
-        // TODO: optional, use two convolutions with 1d gaussian filter.
-        // If you implement, disable the above if check.
-        return copy_image(im);
+        float x = S.data[i];
+        float y = S.data[i + plane];
+        S.data[i] = x * x;
+        S.data[i + plane] = y * y;
+        S.data[i + 2 * plane] = x * y;
     }
 }
 
@@ -122,45 +151,46 @@ image smooth_image(image im, float sigma)
 image structure_matrix(image im, float sigma)
 {
     image S = make_image(im.w, im.h, 3);
+    int plane = im.w * im.h;
 
-    // Calculate image derivatives Ix and Iy by sobel filters
-    image ix = convolve_image(im, make_gx_filter(), 0);
-    image iy = convolve_image(im, make_gy_filter(), 0);
+    // Calculate image derivatives Ix and Iy by sobel filters,
+    // written straight into the first two channels of S
+    image ix = S;
+    image iy = S;
+    ix.c = iy.c = 1;
+    iy.data += plane;
+    image none = {0};
+    sobel_gradient(im, ix, iy, none, none, GRADIENT_EXACT);
 
     // Calculate measures IxIx, IyIy, and IxIy
-    float x, y;
-    for (int i = 0; i < im.w; i++)
-        for (int j = 0; j < im.h; j++)
-        {
-            x = get_pixel(ix, i, j, 0);
-            y = get_pixel(iy, i, j, 0);
-
-            // store measures in different channels of the image
-            set_pixel(S, i, j, 0, x * x);
-            set_pixel(S, i, j, 1, y * y);
-            set_pixel(S, i, j, 2, x * y);
-        }
-    free_image(ix);
-    free_image(iy);
+    // and store them in the different channels of S
+    parallel_for(plane, PARALLEL_MIN_WORK / 4, structure_products, &S);
 
     // Return weighted sum of nearby measures with a Gaussian blur
-    return smooth_image(S, sigma);
+    image smoothed = smooth_image(S, sigma);
+    free_image(S);
+    return smoothed;
 }
 
-// Estimate the cornerness of each pixel given a structure matrix S.
-// image S: structure matrix for an image.
-// returns: a response map of cornerness calculations.
-image cornerness_response(image S)
-{
-    // det(S) - alpha * trace(S)^2, alpha = .06.
+// Arguments of cornerness_response and nms_image for parallel_for.
+typedef struct{
+    image im;
+    image out;
+    int w;
+} response_job;
 
-    image R = make_image(S.w, S.h, 1);
+// Rows j0 .. j1 - 1 of cornerness_response.
+void cornerness_rows(void *ctx, int j0, int j1)
+{
+    response_job *job = ctx;
+    image S = job->im;
+    image R = job->out;
     float alpha = 0.06;
     float xx, yy, xy, det, tr;
 
     // loop over every pixel in the structure matrix and calculate R
-    for (int i = 0; i < S.w; i++)
-        for (int j = 0; j < S.h; j++)
+    for (int j = j0; j < j1; j++)
+        for (int i = 0; i < S.w; i++)
         {
             xx = get_pixel(S, i, j, 0);
             yy = get_pixel(S, i, j, 1);
@@ -171,22 +201,32 @@ image cornerness_response(image S)
             tr = xx + yy;
             set_pixel(R, i, j, 0, det - alpha * tr * tr);
         }
+}
+
+// Estimate the cornerness of each pixel given a structure matrix S.
+// image S: structure matrix for an image.
+// returns: a response map of cornerness calculations.
+image cornerness_response(image S)
+{
+    // det(S) - alpha * trace(S)^2, alpha = .06.
+    response_job job = {S, make_image(S.w, S.h, 1)};
+    parallel_for(S.h, parallel_grain(8. * S.w), cornerness_rows, &job);
 
     // return "cornerness" for each pixel
-    return R;
+    return job.out;
 }
 
-// Perform non-max supression on an image of feature responses.
-// image im: 1-channel image of feature responses.
-// int w: distance to look for larger responses.
-// returns: image with only local-maxima responses within w pixels.
-image nms_image(image im, int w)
+// Rows j0 .. j1 - 1 of nms_image.
+void nms_rows(void *ctx, int j0, int j1)
 {
-    image r = copy_image(im);
+    response_job *job = ctx;
+    image im = job->im;
+    image r = job->out;
+    int w = job->w;
 
     // for every pixel in the image
-    for (int i = 0; i < r.w; i++)
-        for (int j = 0; j < r.h; j++)
+    for (int j = j0; j < j1; j++)
+        for (int i = 0; i < r.w; i++)
         {
             // get image pixel value
             float im_pixel = get_pixel(im, i, j, 0);
@@ -207,7 +247,17 @@ image nms_image(image im, int w)
                     }
                 }
         }
-    return r;
+}
+
+// Perform non-max supression on an image of feature responses.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// returns: image with only local-maxima responses within w pixels.
+image nms_image(image im, int w)
+{
+    response_job job = {im, copy_image(im), w};
+    parallel_for(im.h, parallel_grain((2. * w + 1) * (2 * w + 1) * im.w), nms_rows, &job);
+    return job.out;
 }
 
 // Perform harris corner detection and extract features from the corners.
@@ -267,6 +317,36 @@ descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms,
     return d;
 }
 
+// Runs harris_corner_detector on every level of a pyramid, so corners
+// are found at every scale without blurring the full image each time.
+// Descriptors come from the level a corner was found on, its point is
+// in level 0 coordinates.
+// pyramid p: e.g. make_pyramid(im, 3, 1).
+// float sigma, thresh: as for harris_corner_detector, on every level.
+// int nms: as for harris_corner_detector, in pixels of each level.
+// int *n: set to the total number of corners.
+// returns: descriptors of all levels, coarsest last.
+descriptor *harris_pyramid_detector(pyramid p, float sigma, float thresh, int nms, int *n)
+{
+    *n = 0;
+    descriptor *d = 0;
+    for (int k = 0; k < p.n; k++)
+    {
+        int count = 0;
+        descriptor *level = harris_corner_detector(p.levels[k], sigma, thresh, nms, &count);
+        d = realloc(d, (*n + count) * sizeof(descriptor));
+        for (int i = 0; i < count; i++)
+        {
+            level[i].p.x /= p.scale[k];
+            level[i].p.y /= p.scale[k];
+            d[*n + i] = level[i];
+        }
+        *n += count;
+        free(level);
+    }
+    return d;
+}
+
 // Find and draw corners on an image.
 // image im: input image.
 // float sigma: std. dev for harris.
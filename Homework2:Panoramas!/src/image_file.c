@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+// A native container for float images, for intermediates that should
+// come back exactly as they were saved and without decoding. The file
+// is a one page header followed by the pixels as they lie in memory,
+// every plane starting on a page boundary. map_image maps the file and
+// returns an image that points straight into the mapping, so reopening
+// costs a system call no matter how large the image is.
+
+#define IMAGE_FILE_MAGIC "UWIMG\r\n\032"
+#define IMAGE_FILE_VERSION 1
+#define IMAGE_FILE_PAGE 4096
+
+// Sample types a container can hold, only floats so far.
+#define IMAGE_FILE_F32 0
+
+// int ystride, cstride: samples between rows and between planes.
+// long long offset, bytes: where the pixels start in the file and how
+// many bytes they take, padding after the last plane not included.
+// long long mapped: 0 in the file, map_image sets it in its private
+// copy to the length of the mapping.
+typedef struct{
+    char magic[8];
+    int version;
+    int w, h, c;
+    int dtype;
+    int layout;
+    int ystride, cstride;
+    long long offset, bytes;
+    long long mapped;
+} image_file_header;
+
+// Writes n bytes of zeros.
+static int write_zeros(FILE *f, size_t n)
+{
+    static const char zeros[IMAGE_FILE_PAGE];
+    while (n)
+    {
+        size_t k = MIN(n, sizeof(zeros));
+        if (fwrite(zeros, 1, k, f) != k)
+            return 0;
+        n -= k;
+    }
+    return 1;
+}
+
+// Whether the size, layout and strides of a header describe pixels that
+// all lie within its bytes, so no get_pixel can reach past the mapping.
+int valid_header(const image_file_header *hd)
+{
+    if (hd->w <= 0 || hd->h <= 0 || hd->c <= 0 || hd->ystride < 0 || hd->cstride < 0)
+        return 0;
+    if (hd->layout != LAYOUT_CHW && hd->layout != LAYOUT_HWC)
+        return 0;
+    long long row = hd->layout == LAYOUT_HWC ? (long long)hd->w * hd->c : hd->w;
+    long long ystride = hd->ystride ? hd->ystride : row;
+    long long cstride = hd->cstride ? hd->cstride : (long long)hd->w * hd->h;
+    if (ystride < row)
+        return 0;
+    if (hd->layout == LAYOUT_HWC)
+        return ((hd->h - 1) * ystride + row) * (long long)sizeof(float) <= hd->bytes;
+    if (cstride < ystride * hd->h)
+        return 0;
+    return ((hd->c - 1) * cstride + (hd->h - 1) * ystride + hd->w) * (long long)sizeof(float) <= hd->bytes;
+}
+
+// Saves an image in the native container, to be opened with map_image.
+// Pixels are written as they are, padding and layout included, and
+// come back bit for bit.
+// image im: image to save, any layout.
+// const char *name: file name, .uwi is appended.
+void save_image_native(image im, const char *name)
+{
+    char buff[256];
+    sprintf(buff, "%s.uwi", name);
+    FILE *f = fopen(buff, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Failed to write image %s\n", buff);
+        return;
+    }
+
+    // rows keep their pitch, planes are rounded up to whole pages
+    int page = IMAGE_FILE_PAGE / sizeof(float);
+    int planes = im.layout == LAYOUT_HWC ? 1 : im.c;
+    size_t plane = (size_t)im.h * image_ystride(im);
+    size_t cstride = planes == 1 ? plane : (plane + page - 1) / page * page;
+
+    image_file_header hd = {IMAGE_FILE_MAGIC, IMAGE_FILE_VERSION, im.w, im.h, im.c,
+                            IMAGE_FILE_F32, im.layout, image_ystride(im), (int)cstride,
+                            IMAGE_FILE_PAGE, 0, 0};
+    // packed images stay packed
+    if (hd.ystride == (im.layout == LAYOUT_HWC ? im.w * im.c : im.w))
+        hd.ystride = 0;
+    if (im.layout == LAYOUT_HWC || cstride == (size_t)im.w * im.h)
+        hd.cstride = 0;
+    hd.bytes = (long long)((planes - 1) * cstride + plane) * sizeof(float);
+
+    int ok = fwrite(&hd, sizeof(hd), 1, f) == 1 && write_zeros(f, IMAGE_FILE_PAGE - sizeof(hd));
+    for (int k = 0; ok && k < planes; k++)
+    {
+        const float *p = im.data + (size_t)k * image_cstride(im);
+        ok = fwrite(p, sizeof(float), plane, f) == plane;
+        if (ok && k < planes - 1)
+            ok = write_zeros(f, (cstride - plane) * sizeof(float));
+    }
+    if (fclose(f) || !ok)
+        fprintf(stderr, "Failed to write image %s\n", buff);
+}
+
+// Opens an image saved with save_image_native without reading it. The
+// pixels are paged in from the file as they are touched. The mapping is
+// private: the image can be written to, but changes never reach the
+// file. Free it with free_mapped_image, not free_image.
+// char *filename: the file, .uwi included.
+// returns: the image, with data 0 if the file can't be opened.
+image map_image(char *filename)
+{
+    image im = {0};
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+    {
+        fprintf(stderr, "Cannot open image \"%s\"\n", filename);
+        if (fd >= 0) close(fd);
+        return im;
+    }
+    void *base = MAP_FAILED;
+    if (st.st_size >= IMAGE_FILE_PAGE)
+        base = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map image \"%s\"\n", filename);
+        return im;
+    }
+
+    image_file_header *hd = base;
+    if (memcmp(hd->magic, IMAGE_FILE_MAGIC, sizeof(hd->magic)) || hd->version != IMAGE_FILE_VERSION ||
+        hd->dtype != IMAGE_FILE_F32 || hd->offset != IMAGE_FILE_PAGE ||
+        hd->bytes < 0 || hd->bytes > st.st_size - hd->offset || !valid_header(hd))
+    {
+        fprintf(stderr, "Cannot load image \"%s\": not a native image file\n", filename);
+        munmap(base, st.st_size);
+        return im;
+    }
+    // the private copy of the header remembers how much to unmap
+    hd->mapped = st.st_size;
+    im.w = hd->w;
+    im.h = hd->h;
+    im.c = hd->c;
+    im.layout = hd->layout;
+    im.ystride = hd->ystride;
+    im.cstride = hd->cstride;
+    im.data = (float *)((char *)base + hd->offset);
+    return im;
+}
+
+// Unmaps an image from map_image.
+void free_mapped_image(image im)
+{
+    if (!im.data)
+        return;
+    image_file_header *hd = (image_file_header *)((char *)im.data - IMAGE_FILE_PAGE);
+    munmap(hd, hd->mapped);
+}
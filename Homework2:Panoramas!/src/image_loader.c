@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+#include "parallel.h"
+
+// Loads a list of images ahead of the code that uses them. Threads of
+// the loader decode the files while the caller works on the images it
+// already has, and next_loaded_image hands them out in list order.
+// Image i goes to slot i % depth of a ring and is only started once
+// image i - depth has been taken, so no more than depth decoded images
+// wait in memory however far behind the caller is.
+
+struct loader_queue{
+    char **paths;
+    int n, depth;
+    int next;               // next image a thread starts on
+    int taken;              // images handed out so far
+    int stop;
+    image *slots;
+    int *ready;
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+void *loader_thread(void *arg)
+{
+    struct loader_queue *q = arg;
+    // decoding is spread over images, not over the rows of one
+    set_thread_serial(1);
+    pthread_mutex_lock(&q->lock);
+    for (;;)
+    {
+        while (!q->stop && q->next < q->n && q->next >= q->taken + q->depth)
+            pthread_cond_wait(&q->changed, &q->lock);
+        if (q->stop || q->next >= q->n)
+            break;
+        int i = q->next++;
+        pthread_mutex_unlock(&q->lock);
+
+        image im = try_load_image_stb(q->paths[i], 0);
+
+        pthread_mutex_lock(&q->lock);
+        q->slots[i % q->depth] = im;
+        q->ready[i % q->depth] = 1;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Starts loading images in the background.
+// char **paths: the files, copied, so they can go once this returns.
+// int n: number of files.
+// int depth: most images loaded ahead of the caller, at least 1.
+// int threads: threads that decode, 0 for one per core up to depth.
+// returns: the loader, take the images with next_loaded_image.
+image_loader start_image_loader(char **paths, int n, int depth, int threads)
+{
+    struct loader_queue *q = calloc(1, sizeof(struct loader_queue));
+    q->n = n;
+    q->depth = MAX(depth, 1);
+    q->paths = calloc(n, sizeof(char *));
+    for (int i = 0; i < n; i++)
+        q->paths[i] = strdup(paths[i]);
+    q->slots = calloc(q->depth, sizeof(image));
+    q->ready = calloc(q->depth, sizeof(int));
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->changed, 0);
+
+    if (threads <= 0)
+        threads = get_num_threads();
+    threads = MAX(1, MIN(threads, MIN(q->depth, n)));
+    q->threads = calloc(threads, sizeof(pthread_t));
+    for (q->nthreads = 0; q->nthreads < threads; q->nthreads++)
+    {
+        if (pthread_create(&q->threads[q->nthreads], 0, loader_thread, q))
+            break;
+    }
+    if (q->nthreads == 0)
+        fprintf(stderr, "Cannot start image loader threads\n");
+
+    image_loader l = {n, q};
+    return l;
+}
+
+// Takes the next image of a loader, waiting for it if it isn't loaded
+// yet. The image belongs to the caller, free it with free_image.
+// image *im: set to the image, data 0 if the file couldn't be loaded.
+// returns: 1, or 0 once every image has been taken.
+int next_loaded_image(image_loader l, image *im)
+{
+    struct loader_queue *q = l.queue;
+    pthread_mutex_lock(&q->lock);
+    if (q->taken >= q->n || q->nthreads == 0)
+    {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    int s = q->taken % q->depth;
+    while (!q->ready[s])
+        pthread_cond_wait(&q->changed, &q->lock);
+    *im = q->slots[s];
+    q->ready[s] = 0;
+    q->taken++;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+// Stops a loader, waiting for files being decoded, and frees it along
+// with the images no one took.
+void stop_image_loader(image_loader l)
+{
+    struct loader_queue *q = l.queue;
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_broadcast(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->nthreads; i++)
+        pthread_join(q->threads[i], 0);
+
+    for (int s = 0; s < q->depth; s++)
+        if (q->ready[s]) free_image(q->slots[s]);
+    for (int i = 0; i < q->n; i++)
+        free(q->paths[i]);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->changed);
+    free(q->threads);
+    free(q->paths);
+    free(q->slots);
+    free(q->ready);
+    free(q);
+}
@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+
+// Fills the summed area table of one plane, extended by pad pixels on
+// every side with clamp padding. Tables are (w + 2pad + 1) x (h + 2pad + 1)
+// with a leading row and column of zeros, entry (X, Y) holds the sum of
+// all padded pixels left of X and above Y. Sums are kept in double so
+// differences of large corner values stay exact to well below a float ulp.
+// const float *src: w x h plane.
+// double *sum: table of values, required.
+// double *sq: table of squared values, may be 0.
+void integral_plane(const float *src, int w, int h, int pad, double *sum, double *sq)
+{
+    int tw = w + 2 * pad + 1;
+    int th = h + 2 * pad + 1;
+    memset(sum, 0, tw * sizeof(double));
+    if (sq)
+        memset(sq, 0, tw * sizeof(double));
+
+    for (int Y = 1; Y < th; Y++)
+    {
+        const float *row = src + clamp_padding(Y - 1 - pad, 0, h) * w;
+        double *above = sum + (Y - 1) * tw;
+        double *cur = sum + Y * tw;
+        double run = 0;
+        cur[0] = 0;
+        for (int X = 1; X < tw; X++)
+        {
+            run += row[clamp_padding(X - 1 - pad, 0, w)];
+            cur[X] = above[X] + run;
+        }
+        if (!sq)
+            continue;
+        above = sq + (Y - 1) * tw;
+        cur = sq + Y * tw;
+        run = 0;
+        cur[0] = 0;
+        for (int X = 1; X < tw; X++)
+        {
+            double v = row[clamp_padding(X - 1 - pad, 0, w)];
+            run += v * v;
+            cur[X] = above[X] + run;
+        }
+    }
+}
+
+// Builds summed area tables for every channel of an image.
+// image im: the image.
+// int pad: how far past the borders queries may reach, clamp padded.
+// int squares: whether to also build the table of squared values,
+//              needed for variances. It doubles the memory.
+// returns: the tables.
+integral_image make_integral_image(image im, int pad, int squares)
+{
+    // tables are built one plane at a time
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        integral_image ii = make_integral_image(planar, pad, squares);
+        free_image(planar);
+        return ii;
+    }
+    integral_image ii;
+    ii.w = im.w;
+    ii.h = im.h;
+    ii.c = im.c;
+    ii.pad = pad;
+    size_t n = (size_t)(im.w + 2 * pad + 1) * (im.h + 2 * pad + 1);
+    ii.sum = calloc(n * im.c, sizeof(double));
+    ii.sq = squares ? calloc(n * im.c, sizeof(double)) : 0;
+    for (int c = 0; c < im.c; c++)
+    {
+        integral_plane(im.data + c * im.w * im.h, im.w, im.h, pad,
+                       ii.sum + c * n, ii.sq ? ii.sq + c * n : 0);
+    }
+    return ii;
+}
+
+void free_integral_image(integral_image ii)
+{
+    free(ii.sum);
+    free(ii.sq);
+}
+
+// Sum over the rectangle [x0, x1) x [y0, y1) of one table.
+// The rectangle is clipped to the padded extent of the table.
+double integral_table_sum(integral_image ii, const double *table, int x0, int y0, int x1, int y1, int c)
+{
+    int tw = ii.w + 2 * ii.pad + 1;
+    int th = ii.h + 2 * ii.pad + 1;
+    const double *t = table + (size_t)c * tw * th;
+
+    // to table coordinates
+    x0 = clamp_padding(x0 + ii.pad, 0, tw);
+    x1 = clamp_padding(x1 + ii.pad, 0, tw);
+    y0 = clamp_padding(y0 + ii.pad, 0, th);
+    y1 = clamp_padding(y1 + ii.pad, 0, th);
+    if (x1 <= x0 || y1 <= y0)
+        return 0;
+    return t[y1 * tw + x1] - t[y0 * tw + x1] - t[y1 * tw + x0] + t[y0 * tw + x0];
+}
+
+// Sum of the pixel values of channel c over [x0, x1) x [y0, y1) in O(1).
+// Coordinates are image coordinates and may reach pad pixels outside
+// the image, where values are clamp padded.
+double integral_sum(integral_image ii, int x0, int y0, int x1, int y1, int c)
+{
+    return integral_table_sum(ii, ii.sum, x0, y0, x1, y1, c);
+}
+
+// Sum of the squared pixel values, the tables must have been built with squares.
+double integral_sq_sum(integral_image ii, int x0, int y0, int x1, int y1, int c)
+{
+    assert(ii.sq);
+    return integral_table_sum(ii, ii.sq, x0, y0, x1, y1, c);
+}
+
+// Mean of channel c over [x0, x1) x [y0, y1).
+float integral_mean(integral_image ii, int x0, int y0, int x1, int y1, int c)
+{
+    int n = (x1 - x0) * (y1 - y0);
+    return n > 0 ? integral_sum(ii, x0, y0, x1, y1, c) / n : 0;
+}
+
+// Variance of channel c over [x0, x1) x [y0, y1), E[v^2] - E[v]^2.
+float integral_variance(integral_image ii, int x0, int y0, int x1, int y1, int c)
+{
+    int n = (x1 - x0) * (y1 - y0);
+    if (n <= 0)
+        return 0;
+    double mean = integral_sum(ii, x0, y0, x1, y1, c) / n;
+    double var = integral_sq_sum(ii, x0, y0, x1, y1, c) / n - mean * mean;
+    return var > 0 ? var : 0;
+}
+
+// Arguments of the table lookups in convolve_box and local_mean_variance
+// for parallel_for.
+typedef struct{
+    integral_image ii;
+    int fw, fh;
+    float weight;
+    float *out;
+    image mean, var;
+} box_job;
+
+// Output rows y0 .. y1 - 1 of one channel of convolve_box.
+void convolve_box_rows(void *ctx, int y0, int y1)
+{
+    box_job *job = ctx;
+    integral_image ii = job->ii;
+    int fw = job->fw;
+    int fh = job->fh;
+    for (int y = y0; y < y1; y++)
+    {
+        int top = y - fh / 2;
+        for (int x = 0; x < ii.w; x++)
+        {
+            int left = x - fw / 2;
+            job->out[x + y * ii.w] = job->weight * integral_sum(ii, left, top, left + fw, top + fh, 0);
+        }
+    }
+}
+
+// Convolves an image with a constant fw x fh filter using summed area
+// tables, 4 lookups per pixel whatever the filter size. Same window
+// placement, clamp padding and channel semantics as convolve_image.
+// float weight: the value of every filter entry.
+image convolve_box(image im, int fw, int fh, float weight, int preserve)
+{
+    // the paths below index planes directly
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        image out = convolve_box(planar, fw, fh, weight, preserve);
+        free_image(planar);
+        set_layout(&out, im.layout);
+        return out;
+    }
+    int numOfChannel = preserve == 1 ? im.c : 1;
+    int plane = im.w * im.h;
+    int pad = MAX(fw / 2, fh / 2);
+    image convolved = make_image(im.w, im.h, numOfChannel);
+
+    // one channel of tables at a time keeps the memory bounded
+    image one = make_image(im.w, im.h, 1);
+    for (int k = 0; k < numOfChannel; k++)
+    {
+        if (numOfChannel == 1)
+        {
+            // convolution is linear, sum the channels first
+            for (int c = 0; c < im.c; c++)
+                for (int i = 0; i < plane; i++)
+                    one.data[i] += im.data[i + c * plane];
+        }
+        else
+        {
+            memcpy(one.data, im.data + k * plane, plane * sizeof(float));
+        }
+
+        box_job job = {make_integral_image(one, pad, 0), fw, fh, weight, convolved.data + k * plane};
+        parallel_for(im.h, parallel_grain(8. * im.w), convolve_box_rows, &job);
+        free_integral_image(job.ii);
+    }
+    free_image(one);
+    return convolved;
+}
+
+// Box filters an image, the same as convolving with make_box_filter(w)
+// and preserving channels, in constant time per pixel.
+// image im: image to filter.
+// int w: width of the box.
+// returns: filtered image.
+image box_filter_image(image im, int w)
+{
+    return convolve_box(im, w, w, 1. / (w * w), 1);
+}
+
+// Rows y0 .. y1 - 1 of local_mean_variance, all channels.
+void local_mean_variance_rows(void *ctx, int y0, int y1)
+{
+    box_job *job = ctx;
+    integral_image ii = job->ii;
+    int w = job->fw;
+    for (int c = 0; c < ii.c; c++)
+    {
+        for (int y = y0; y < y1; y++)
+        {
+            int top = y - w / 2;
+            for (int x = 0; x < ii.w; x++)
+            {
+                int left = x - w / 2;
+                int i = x + y * ii.w + c * ii.w * ii.h;
+                job->mean.data[i] = integral_mean(ii, left, top, left + w, top + w, c);
+                job->var.data[i] = integral_variance(ii, left, top, left + w, top + w, c);
+            }
+        }
+    }
+}
+
+// Local mean and variance of every pixel over the w x w window centered
+// on it, clamp padded. Both come from one pair of summed area tables.
+// image im: input image.
+// int w: width of the window.
+// returns: two images with the channels of im, the mean and the variance.
+image *local_mean_variance(image im, int w)
+{
+    image *mean_and_var = calloc(2, sizeof(image));
+    mean_and_var[0] = make_image(im.w, im.h, im.c);
+    mean_and_var[1] = make_image(im.w, im.h, im.c);
+
+    box_job job = {make_integral_image(im, w / 2, 1), w, w};
+    job.mean = mean_and_var[0];
+    job.var = mean_and_var[1];
+    parallel_for(im.h, parallel_grain(20. * im.w * im.c), local_mean_variance_rows, &job);
+    free_integral_image(job.ii);
+    set_layout(&mean_and_var[0], im.layout);
+    set_layout(&mean_and_var[1], im.layout);
+    return mean_and_var;
+}
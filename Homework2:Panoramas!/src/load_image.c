@@ -1,8 +1,11 @@
 // You probably don't want to edit this file
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 
 #include "image.h"
+#include "parallel.h"
 
 image make_empty_image(int w, int h, int c)
 {
@@ -11,13 +14,61 @@ image make_empty_image(int w, int h, int c)
     out.h = h;
     out.w = w;
     out.c = c;
+    out.layout = LAYOUT_CHW;
+    out.ystride = 0;
+    out.cstride = 0;
     return out;
 }
 
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.data = alloc_pixels((size_t)h*w*c, 1);
+    return out;
+}
+
+// make_image without clearing the pixels, for outputs a kernel is
+// about to overwrite in full.
+image make_image_uninit(int w, int h, int c)
+{
+    image out = make_empty_image(w,h,c);
+    out.data = alloc_pixels((size_t)h*w*c, 0);
+    return out;
+}
+
+// Makes a zeroed CHW image whose rows and planes start on IMAGE_ALIGN
+// boundaries. Kernels that take views, get_pixel and set_pixel run on it
+// as is, planar only fast paths work on a packed copy.
+// int pitch: floats between rows, at least w, or 0 to round w up to a
+//            whole number of cache lines. Row and plane sizes that are
+//            multiples of 4 KB get an extra line, so the same pixel of
+//            neighbouring rows or planes doesn't alias in the L1 cache.
+image make_padded_image(int w, int h, int c, int pitch)
+{
+    int line = IMAGE_ALIGN / sizeof(float);
+    if (pitch == 0)
+    {
+        pitch = (w + line - 1) / line * line;
+        if (pitch * sizeof(float) % 4096 == 0)
+            pitch += line;
+    }
+    assert(pitch >= w);
+    int plane = ((long)h * pitch + line - 1) / line * line;
+    if (plane * sizeof(float) % 4096 == 0)
+        plane += line;
+
+    image out = make_empty_image(w,h,c);
+    out.ystride = pitch;
+    out.cstride = plane;
+    out.data = alloc_pixels(image_floats(out), 1);
+    return out;
+}
+
+// make_image with a given pixel layout, LAYOUT_CHW or LAYOUT_HWC.
+image make_image_layout(int w, int h, int c, int layout)
+{
+    image out = make_image(w, h, c);
+    out.layout = layout;
     return out;
 }
 
@@ -26,16 +77,169 @@ image make_image(int w, int h, int c)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(image im, const char *name, int png)
+// Arguments of the conversions between interleaved bytes, as stb reads
+// and writes them, and float images, for parallel_for over rows.
+typedef struct{
+    unsigned char *bytes;   // c bytes per pixel, w * c per row
+    int c;
+    float *data;            // keep floats per pixel, planar or not
+    int keep;
+    int w;
+    size_t plane;           // floats per plane, 0 for LAYOUT_HWC
+    unsigned char *planes;  // 8 bit planes instead of data, see load_image_u8
+} interleave_job;
+
+// Spreads n pixels of c interleaved bytes over the first keep planes,
+// scaled to 0 .. 1. Each row is read while it is in cache, so all the
+// planes fill in a single pass over the bytes. The multiply is done in
+// double, which gives exactly the value of dividing by 255.
+static inline void deinterleave_span(const unsigned char *src, int n, int c, int keep, float *dst, size_t plane)
 {
-    char buff[256];
-    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
-    int i,k;
-    for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
+    const double scale = 1. / 255;
+    for (int k = 0; k < keep; k++)
+    {
+        float *out = dst + k * plane;
+        for (int i = 0; i < n; i++)
+            out[i] = (float)(src[i * c + k] * scale);
+    }
+}
+
+// deinterleave_span to 8 bit planes, values as they are.
+static inline void deinterleave_span_u8(const unsigned char *src, int n, int c, int keep, unsigned char *dst, size_t plane)
+{
+    for (int k = 0; k < keep; k++)
+    {
+        unsigned char *out = dst + k * plane;
+        for (int i = 0; i < n; i++)
+            out[i] = src[i * c + k];
+    }
+}
+
+// The inverse, clamped to 0 .. 255 and rounded.
+static inline void interleave_span(const float *src, size_t plane, int c, int n, unsigned char *dst)
+{
+    for (int i = 0; i < n; i++)
+    {
+        for (int k = 0; k < c; k++)
+        {
+            float v = src[k * plane + i] * 255;
+            v = v < 0 ? 0 : v;
+            v = v > 255 ? 255 : v;
+            dst[i * c + k] = (unsigned char)(v + .5f);
+        }
+    }
+}
+
+// Rows y0 .. y1 - 1 of interleaved_to_image. The usual channel counts
+// get their own loops so the compiler can vectorize the shuffles.
+void deinterleave_rows(void *ctx, int y0, int y1)
+{
+    interleave_job *job = ctx;
+    int w = job->w, c = job->c, keep = job->keep;
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char *src = job->bytes + (size_t)y * w * c;
+        if (!job->plane)
+        {
+            float *dst = job->data + (size_t)y * w * keep;
+            if (keep == c)
+                deinterleave_span(src, w * c, 1, 1, dst, 0);
+            else
+                for (int k = 0; k < keep; k++)
+                    for (int i = 0; i < w; i++)
+                        dst[i * keep + k] = (float)(src[i * c + k] * (1. / 255));
+            continue;
+        }
+        float *dst = job->data + (size_t)y * w;
+        switch (c * 8 + keep)
+        {
+            case 1 * 8 + 1: deinterleave_span(src, w, 1, 1, dst, job->plane); break;
+            case 3 * 8 + 3: deinterleave_span(src, w, 3, 3, dst, job->plane); break;
+            case 4 * 8 + 3: deinterleave_span(src, w, 4, 3, dst, job->plane); break;
+            case 4 * 8 + 4: deinterleave_span(src, w, 4, 4, dst, job->plane); break;
+            default: deinterleave_span(src, w, c, keep, dst, job->plane); break;
         }
     }
+}
+
+// Rows y0 .. y1 - 1 of load_image_u8.
+void deinterleave_u8_rows(void *ctx, int y0, int y1)
+{
+    interleave_job *job = ctx;
+    int w = job->w, c = job->c, keep = job->keep;
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char *src = job->bytes + (size_t)y * w * c;
+        unsigned char *dst = job->planes + (size_t)y * w;
+        switch (c * 8 + keep)
+        {
+            case 3 * 8 + 3: deinterleave_span_u8(src, w, 3, 3, dst, job->plane); break;
+            case 4 * 8 + 3: deinterleave_span_u8(src, w, 4, 3, dst, job->plane); break;
+            default: deinterleave_span_u8(src, w, c, keep, dst, job->plane); break;
+        }
+    }
+}
+
+// Rows y0 .. y1 - 1 of image_to_interleaved.
+void interleave_rows(void *ctx, int y0, int y1)
+{
+    interleave_job *job = ctx;
+    int w = job->w, c = job->c;
+    for (int y = y0; y < y1; y++)
+    {
+        unsigned char *dst = job->bytes + (size_t)y * w * c;
+        if (!job->plane)
+        {
+            interleave_span(job->data + (size_t)y * w * c, 0, 1, w * c, dst);
+            continue;
+        }
+        const float *src = job->data + (size_t)y * w;
+        switch (c)
+        {
+            case 1: interleave_span(src, job->plane, 1, w, dst); break;
+            case 3: interleave_span(src, job->plane, 3, w, dst); break;
+            case 4: interleave_span(src, job->plane, 4, w, dst); break;
+            default: interleave_span(src, job->plane, c, w, dst); break;
+        }
+    }
+}
+
+// Makes a float image from interleaved 8 bit pixels, as image loaders
+// return them, in one pass over the bytes.
+// unsigned char *data: h rows of w pixels of c bytes.
+// int keep: channels to keep, the first keep of each pixel.
+// int layout: LAYOUT_CHW or LAYOUT_HWC.
+// returns: the w x h x keep image, scaled to 0 .. 1.
+image interleaved_to_image(unsigned char *data, int w, int h, int c, int keep, int layout)
+{
+    assert(keep > 0 && keep <= c);
+    image im = make_image_uninit(w, h, keep);
+    im.layout = layout;
+    interleave_job job = {data, c, im.data, keep, w, layout == LAYOUT_HWC ? 0 : (size_t)w*h};
+    parallel_for(h, parallel_grain(2. * w * c), deinterleave_rows, &job);
+    return im;
+}
+
+// Writes an image as interleaved 8 bit pixels in one pass, clamped to
+// 0 .. 1 and rounded to the nearest of the 256 levels.
+// unsigned char *out: room for w * h * c bytes.
+void image_to_interleaved(image im, unsigned char *out)
+{
+    if(!is_packed_chw(im) && (im.layout != LAYOUT_HWC || image_ystride(im) != im.w*im.c)){
+        image packed = to_layout(im, im.layout);
+        image_to_interleaved(packed, out);
+        free_image(packed);
+        return;
+    }
+    interleave_job job = {out, im.c, im.data, im.c, im.w, im.layout == LAYOUT_HWC ? 0 : (size_t)im.w*im.h};
+    parallel_for(im.h, parallel_grain(3. * im.w * im.c), interleave_rows, &job);
+}
+
+void save_image_stb(image im, const char *name, int png)
+{
+    char buff[256];
+    unsigned char *data = malloc((size_t)im.w*im.h*im.c);
+    image_to_interleaved(im, data);
     int success = 0;
     if(png){
         sprintf(buff, "%s.png", name);
@@ -58,45 +262,196 @@ void save_image(image im, const char *name)
     save_image_stb(im, name, 0);
 }
 
+// Decodes a file with stb, saying why on stderr when it can't.
+// int *w, *h, *c: set to the size and the channels of the pixels.
+// int channels: 0 to keep the channels of the file, else as many.
+// returns: interleaved 8 bit pixels to free with free, 0 on failure.
+unsigned char *decode_image_stb(char *filename, int *w, int *h, int *c, int channels)
+{
+    unsigned char *data = stbi_load(filename, w, h, c, channels);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        return 0;
+    }
+    if (channels) *c = channels;
+    return data;
+}
+
 // 
 // Load an image using stb
 // channels = [0..4]
 // channels > 0 forces the image to have that many channels
+// returns an empty image with data 0 if the file can't be loaded
 //
-image load_image_stb(char *filename, int channels)
+image try_load_image_stb(char *filename, int channels)
 {
     int w, h, c;
-    unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
-    if (!data) {
-        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
-            filename, stbi_failure_reason());
-        exit(0);
-    }
-    if (channels) c = channels;
-    int i,j,k;
-    image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
-    }
+    unsigned char *data = decode_image_stb(filename, &w, &h, &c, channels);
+    if (!data) return make_empty_image(0, 0, 0);
     //We don't like alpha channels, #YOLO
-    if(im.c == 4) im.c = 3;
+    image im = interleaved_to_image(data, w, h, c, c == 4 ? 3 : c, LAYOUT_CHW);
     free(data);
     return im;
 }
 
+// try_load_image_stb that gives up when the file can't be loaded.
+image load_image_stb(char *filename, int channels)
+{
+    image im = try_load_image_stb(filename, channels);
+    if (!im.data) exit(0);
+    return im;
+}
+
 image load_image(char *filename)
 {
     image out = load_image_stb(filename, 0);
     return out;
 }
 
+// Loads an image in LAYOUT_HWC, keeping stb's interleaved order so
+// nothing is transposed on the way in or, with save_image, out.
+image load_image_hwc(char *filename)
+{
+    int w, h, c;
+    unsigned char *data = decode_image_stb(filename, &w, &h, &c, 0);
+    if (!data) exit(0);
+    //We don't like alpha channels here either
+    int keep = c == 4 ? 3 : c;
+    image im = interleaved_to_image(data, w, h, c, keep, LAYOUT_HWC);
+    free(data);
+    return im;
+}
+
+// Loads an 8 bit image without expanding it to floats. Pixels are
+// moved into planes and that is all, so this is load_image at a quarter
+// of the memory and a fraction of the time.
+image_u8 load_image_u8(char *filename)
+{
+    int w, h, c;
+    unsigned char *data = decode_image_stb(filename, &w, &h, &c, 0);
+    if (!data) exit(0);
+    //No alpha channels here either
+    int keep = c == 4 ? 3 : c;
+    image_u8 im = make_image_u8(w, h, keep);
+    interleave_job job = {data, c, 0, keep, w, (size_t)w*h, im.data};
+    parallel_for(h, parallel_grain(2. * w * c), deinterleave_u8_rows, &job);
+    free(data);
+    return im;
+}
+
+// Arguments of load_image_gray and load_image_gray_u8 for parallel_for.
+typedef struct{
+    unsigned char *bytes;   // c bytes per pixel, w * c per row
+    int w, c;
+    void *out;              // w floats or bytes per row
+} gray_job;
+
+// Rows y0 .. y1 - 1 of load_image_gray, with the weights and the
+// rounding of rgb_to_grayscale.
+void gray_rows(void *ctx, int y0, int y1)
+{
+    gray_job *job = ctx;
+    int w = job->w, c = job->c;
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char *p = job->bytes + (size_t)y * w * c;
+        float *out = (float *)job->out + (size_t)y * w;
+        if (c < 3)
+        {
+            for (int x = 0; x < w; x++)
+                out[x] = (float)(p[x * c] * (1. / 255));
+            continue;
+        }
+        for (int x = 0; x < w; x++)
+        {
+            float R = (float)p[x * c]/255.;
+            float G = (float)p[x * c + 1]/255.;
+            float B = (float)p[x * c + 2]/255.;
+            out[x] = 0.299 * R + 0.587 * G + 0.114 * B;
+        }
+    }
+}
+
+// Rows y0 .. y1 - 1 of load_image_gray_u8, as rgb_to_grayscale_u8.
+void gray_u8_rows(void *ctx, int y0, int y1)
+{
+    gray_job *job = ctx;
+    int w = job->w, c = job->c;
+    for (int y = y0; y < y1; y++)
+    {
+        const unsigned char *p = job->bytes + (size_t)y * w * c;
+        unsigned char *out = (unsigned char *)job->out + (size_t)y * w;
+        if (c < 3)
+        {
+            for (int x = 0; x < w; x++)
+                out[x] = p[x * c];
+            continue;
+        }
+        for (int x = 0; x < w; x++)
+            out[x] = (77*p[x*c] + 150*p[x*c + 1] + 29*p[x*c + 2] + 128) >> 8;
+    }
+}
+
+// Loads an image straight to grayscale: luma is computed while the stb
+// buffer is read, so the color planes are never made. Same values as
+// rgb_to_grayscale(load_image(filename)). Gray files are just expanded.
+image load_image_gray(char *filename)
+{
+    int w, h, c;
+    unsigned char *data = decode_image_stb(filename, &w, &h, &c, 0);
+    if (!data) exit(0);
+    image gray = make_image_uninit(w, h, 1);
+    gray_job job = {data, w, c, gray.data};
+    parallel_for(h, parallel_grain(6. * w), gray_rows, &job);
+    free(data);
+    return gray;
+}
+
+// load_image_gray for 8 bit output, the values of rgb_to_grayscale_u8.
+image_u8 load_image_gray_u8(char *filename)
+{
+    int w, h, c;
+    unsigned char *data = decode_image_stb(filename, &w, &h, &c, 0);
+    if (!data) exit(0);
+    image_u8 gray = make_image_u8(w, h, 1);
+    gray_job job = {data, w, c, gray.data};
+    parallel_for(h, parallel_grain(4. * w), gray_u8_rows, &job);
+    free(data);
+    return gray;
+}
+
 void free_image(image im)
 {
-    free(im.data);
+    free_pixels(im.data);
+}
+
+image_u8 make_image_u8(int w, int h, int c)
+{
+    image_u8 out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.data = alloc_buffer((size_t)w*h*c, 1);
+    return out;
+}
+
+image_f16 make_image_f16(int w, int h, int c)
+{
+    image_f16 out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.data = alloc_buffer((size_t)w*h*c*sizeof(unsigned short), 1);
+    return out;
+}
+
+void free_image_u8(image_u8 im)
+{
+    free_buffer(im.data);
+}
+
+void free_image_f16(image_f16 im)
+{
+    free_buffer(im.data);
 }
@@ -34,21 +34,9 @@ point make_point(float x, float y)
 image both_images(image a, image b)
 {
     image both = make_image(a.w + b.w, a.h > b.h ? a.h : b.h, a.c > b.c ? a.c : b.c);
-    int i,j,k;
-    for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                set_pixel(both, i, j, k, get_pixel(a, i, j, k));
-            }
-        }
-    }
-    for(k = 0; k < b.c; ++k){
-        for(j = 0; j < b.h; ++j){
-            for(i = 0; i < b.w; ++i){
-                set_pixel(both, i+a.w, j, k, get_pixel(b, i, j, k));
-            }
-        }
-    }
+    image_view canvas = view_image(both);
+    copy_to_view(view_image(a), view_channels(view_region(canvas, 0, 0, a.w, a.h), 0, a.c));
+    copy_to_view(view_image(b), view_channels(view_region(canvas, a.w, 0, b.w, b.h), 0, b.c));
     return both;
 }
 
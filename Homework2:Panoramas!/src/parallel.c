@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "image.h"
+#include "parallel.h"
+
+// The library's thread pool. Workers are started on first use and
+// sleep on a condition variable between loops. A loop is cut into
+// chunks of a fixed grain that threads claim from a shared counter, so
+// which thread runs a chunk varies but the chunks themselves, and what
+// each of them computes, never depend on the number of threads.
+
+#define MAX_THREADS 64
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+// serializes loops started from different user threads
+static pthread_mutex_t pool_job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t pool_workers[MAX_THREADS];
+static int pool_threads = 0;   // configured total, caller included, 0 until first use
+static int pool_started = 0;   // workers currently running
+static int pool_shutdown = 0;
+static unsigned long pool_generation = 0;
+static int pool_busy = 0;      // workers still inside the current loop
+
+// the current loop
+static parallel_fn job_fn;
+static void *job_ctx;
+static int job_n, job_grain, job_chunks;
+static int job_next;
+
+// set inside pool workers and while the caller runs its share, so a
+// parallel_for nested in a loop body just runs serially
+static __thread int in_parallel = 0;
+
+// Default thread count: UWIMG_NUM_THREADS if set, else one per core.
+int default_num_threads()
+{
+    char *env = getenv("UWIMG_NUM_THREADS");
+    int n = env ? atoi(env) : 0;
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n;
+}
+
+// Claims and runs chunks of the current loop until there are none left.
+void run_chunks()
+{
+    int k;
+    while ((k = __atomic_fetch_add(&job_next, 1, __ATOMIC_RELAXED)) < job_chunks)
+    {
+        int start = k * job_grain;
+        job_fn(job_ctx, start, MIN(start + job_grain, job_n));
+    }
+}
+
+// void *arg: the loop generation current when the worker was started.
+void *pool_worker(void *arg)
+{
+    in_parallel = 1;
+    unsigned long seen = (unsigned long)arg;
+    pthread_mutex_lock(&pool_lock);
+    for (;;)
+    {
+        while (!pool_shutdown && pool_generation == seen)
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        if (pool_shutdown)
+            break;
+        seen = pool_generation;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_chunks();
+
+        pthread_mutex_lock(&pool_lock);
+        if (--pool_busy == 0)
+            pthread_cond_signal(&pool_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+// Starts the workers for the configured thread count. Holds pool_job_lock.
+void start_pool()
+{
+    if (pool_threads == 0)
+        pool_threads = default_num_threads();
+    pool_threads = MAX(1, MIN(pool_threads, MAX_THREADS));
+
+    // new workers must not mistake the last loop for a pending one
+    pthread_mutex_lock(&pool_lock);
+    pool_shutdown = 0;
+    void *generation = (void *)pool_generation;
+    pthread_mutex_unlock(&pool_lock);
+
+    for (pool_started = 0; pool_started < pool_threads - 1; pool_started++)
+    {
+        if (pthread_create(&pool_workers[pool_started], 0, pool_worker, generation))
+            break;
+    }
+}
+
+// Stops and joins the workers. Holds pool_job_lock.
+void stop_pool()
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_shutdown = 1;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < pool_started; i++)
+        pthread_join(pool_workers[i], 0);
+    pool_started = 0;
+}
+
+// Sets how many threads library kernels use, the calling thread
+// included. 1 runs everything serially, 0 or less goes back to the
+// default: UWIMG_NUM_THREADS if set, else one per core.
+void set_num_threads(int n)
+{
+    pthread_mutex_lock(&pool_job_lock);
+    stop_pool();
+    pool_threads = n > 0 ? MIN(n, MAX_THREADS) : 0;
+    pthread_mutex_unlock(&pool_job_lock);
+}
+
+// Makes parallel_for run serially on the calling thread, for threads
+// that already work alongside others, like those of the image loader,
+// and shouldn't queue for the pool.
+// int serial: 1 to run serially, 0 to use the pool again.
+void set_thread_serial(int serial)
+{
+    in_parallel = serial;
+}
+
+// returns: the number of threads library kernels use.
+int get_num_threads()
+{
+    pthread_mutex_lock(&pool_job_lock);
+    int n = pool_threads ? pool_threads : MIN(default_num_threads(), MAX_THREADS);
+    pthread_mutex_unlock(&pool_job_lock);
+    return n;
+}
+
+// Runs fn over items 0 .. n - 1 in chunks of grain items, spread over
+// the thread pool, and returns when all of them are done. Chunks may
+// run in any order and on any thread, so fn must only write to outputs
+// owned by its own items. Called from inside a loop body it runs serially.
+// int n: number of items, e.g. rows.
+// int grain: items per chunk, enough to make a chunk worth a hand-off.
+// parallel_fn fn: loop body, called as fn(ctx, start, end).
+// void *ctx: passed through to fn.
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx)
+{
+    if (n <= 0)
+        return;
+    grain = MAX(grain, 1);
+    int chunks = (n + grain - 1) / grain;
+    if (chunks == 1 || in_parallel)
+    {
+        fn(ctx, 0, n);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_job_lock);
+    if (pool_threads == 0 || (pool_started == 0 && pool_threads > 1))
+        start_pool();
+    if (pool_started == 0)
+    {
+        pthread_mutex_unlock(&pool_job_lock);
+        fn(ctx, 0, n);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    job_fn = fn;
+    job_ctx = ctx;
+    job_n = n;
+    job_grain = grain;
+    job_chunks = chunks;
+    job_next = 0;
+    pool_busy = pool_started;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    in_parallel = 1;
+    run_chunks();
+    in_parallel = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while (pool_busy > 0)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&pool_job_lock);
+}
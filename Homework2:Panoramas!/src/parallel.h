@@ -0,0 +1,19 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Body of a parallel loop: handles items start .. end - 1.
+// void *ctx: whatever the caller passed to parallel_for.
+typedef void (*parallel_fn)(void *ctx, int start, int end);
+
+// Roughly how many multiply-adds a chunk needs to be worth a hand-off.
+#define PARALLEL_MIN_WORK 32768
+
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx);
+void set_thread_serial(int serial);
+
+// Grain for items that each cost about cost operations.
+static inline int parallel_grain(double cost)
+{
+    return cost >= PARALLEL_MIN_WORK ? 1 : PARALLEL_MIN_WORK / (cost > 1 ? cost : 1);
+}
+#endif
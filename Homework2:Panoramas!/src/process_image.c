@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <math.h>
 #include "image.h"
+#include "parallel.h"
 
 int clamp_padding(int value, int min, int max)
 {
@@ -30,77 +32,410 @@ float get_pixel(image im, int x, int y, int c)
     // in data array the image is stored in CHW format
     // to access a pixel at a certain position:
     // pixel_position(c, y, x) = c * HW + y * W + x
+    // or in HWC format, where it is (y * W + x) * C + c
     // https://oneapi-src.github.io/oneDNN/understanding_memory_formats.html
-    int index = x + (im.w * y) + (im.w * im.h * c);
-    return im.data[index];
+    // padded images put ystride floats between rows, cstride between planes
+    return *view_at(view_image(im), x, y, c);
 }
 
 void set_pixel(image im, int x, int y, int c, float v)
 {
-    im.data[x + im.w * y + im.w * im.h * c] = v;
+    *view_at(view_image(im), x, y, c) = v;
 }
 
-image copy_image(image im)
+// A view of a whole image, with the strides of its layout.
+image_view view_image(image im)
+{
+    image_view v;
+    v.w = im.w;
+    v.h = im.h;
+    v.c = im.c;
+    v.xstride = im.layout == LAYOUT_HWC ? im.c : 1;
+    v.ystride = image_ystride(im);
+    v.cstride = image_cstride(im);
+    v.data = im.data;
+    return v;
+}
+
+// A view of the w x h region of a view with its top left corner at (x, y).
+// The region has to lie inside the view, nothing is copied.
+image_view view_region(image_view v, int x, int y, int w, int h)
+{
+    assert(x >= 0 && y >= 0 && w >= 1 && h >= 1 && x + w <= v.w && y + h <= v.h);
+    image_view r = v;
+    r.w = w;
+    r.h = h;
+    r.data = view_at(v, x, y, 0);
+    return r;
+}
+
+// A view of channels c .. c + n - 1 of a view.
+image_view view_channels(image_view v, int c, int n)
+{
+    assert(c >= 0 && n >= 1 && c + n <= v.c);
+    image_view r = v;
+    r.c = n;
+    r.data = view_at(v, 0, 0, c);
+    return r;
+}
+
+// get_pixel for views, clamped to the view and not the buffer under it.
+float view_get(image_view v, int x, int y, int c)
+{
+    x = clamp_padding(x, 0, v.w);
+    y = clamp_padding(y, 0, v.h);
+    c = clamp_padding(c, 0, v.c);
+    return *view_at(v, x, y, c);
+}
+
+void view_set(image_view v, int x, int y, int c, float val)
 {
-    // return an empty image
-    image copy = make_image(im.w, im.h, im.c);
+    *view_at(v, x, y, c) = val;
+}
 
-    // loop over every channel, width, height index to get all pixels
-    for (int c = 0; c < im.c; c++)
+// Copies the pixels of one view into another of the same size.
+void copy_to_view(image_view src, image_view dst)
+{
+    assert(src.w == dst.w && src.h == dst.h && src.c == dst.c);
+    for (int c = 0; c < src.c; c++)
     {
-        for (int w = 0; w < im.w; w++)
+        for (int y = 0; y < src.h; y++)
         {
-            for (int h = 0; h < im.h; h++)
-            {
-                // get the pixel value of the current position
-                float pixel_value = get_pixel(im, w, h, c);
-
-                // set the pixel value in image copy
-                set_pixel(copy, w, h, c, pixel_value);
-            }
+            const float *in = view_at(src, 0, y, c);
+            float *out = view_at(dst, 0, y, c);
+            if (src.xstride == 1 && dst.xstride == 1)
+                memmove(out, in, src.w * sizeof(float));
+            else
+                for (int x = 0; x < src.w; x++)
+                    out[x * dst.xstride] = in[x * src.xstride];
         }
     }
+}
+
+// Copies a view into a new dense image.
+image copy_view(image_view v)
+{
+    image copy = make_image_uninit(v.w, v.h, v.c);
+    copy_to_view(v, view_image(copy));
     return copy;
 }
 
-image rgb_to_grayscale(image im)
+image copy_image(image im)
 {
-    assert(im.c == 3);
-    // make an empty image with 1 channel
-    image gray = make_image(im.w, im.h, 1);
+    // same size, layout and padding, so the pixels are one block
+    image copy = im;
+    copy.data = alloc_pixels(image_floats(im), 0);
+    memcpy(copy.data, im.data, image_floats(im) * sizeof(float));
+    return copy;
+}
 
-    // loop over every pixel and set RGB values to greyscale
-    for (int x = 0; x < im.w; x++)
+// Copies an image into the given layout, packed. Kernels that only
+// handle packed planar data use this on other input, everything that
+// works through views runs on either layout as is.
+// int layout: LAYOUT_CHW or LAYOUT_HWC.
+image to_layout(image im, int layout)
+{
+    image out = make_image_uninit(im.w, im.h, im.c);
+    out.layout = layout;
+    copy_to_view(view_image(im), view_image(out));
+    return out;
+}
+
+// Arguments of the per-pixel kernels below for parallel_for,
+// each of which runs over rows of a view.
+typedef struct{
+    image_view im;
+    image_view out;
+    int c;
+    float v;
+} pixel_job;
+
+// Rows y0 .. y1 - 1 of rgb_to_grayscale_view.
+void rgb_to_grayscale_rows(void *ctx, int y0, int y1)
+{
+    pixel_job *job = ctx;
+    image_view im = job->im;
+    image_view gray = job->out;
+    for (int y = y0; y < y1; y++)
     {
-        for (int y = 0; y < im.h; y++)
+        const float *p = view_at(im, 0, y, 0);
+        float *out = view_at(gray, 0, y, 0);
+        for (int x = 0; x < im.w; x++)
         {
-            // get R values of the pixel from channel 0
-            float R = get_pixel(im, x, y, 0);
-            // get G values of the pixel from channel 1
-            float G = get_pixel(im, x, y, 1);
-            // get B values of the pixel from channel 2
-            float B = get_pixel(im, x, y, 2);
+            // get R, G and B values of the pixel from channels 0, 1 and 2
+            float R = p[x * im.xstride];
+            float G = p[x * im.xstride + im.cstride];
+            float B = p[x * im.xstride + 2 * im.cstride];
             // use luma claculation to find an approximation of perceptual intensity
             float luma_gray = 0.299 * R + 0.587 * G + 0.114 * B;
             // set pixel value to gray
-            set_pixel(gray, x, y, 0, luma_gray);
+            out[x * gray.xstride] = luma_gray;
         }
     }
+}
+
+// rgb_to_grayscale from one view into another, 1 channel, of the same size.
+void rgb_to_grayscale_view(image_view im, image_view gray)
+{
+    assert(im.c == 3 && gray.w == im.w && gray.h == im.h);
+    pixel_job job = {im, gray};
+    parallel_for(im.h, parallel_grain(8. * im.w), rgb_to_grayscale_rows, &job);
+}
+
+// Converts an image to the given layout in place, replacing its buffer.
+// Kernels that compute planar results call it to hand them back in the
+// layout of their input.
+void set_layout(image *im, int layout)
+{
+    if (im->layout == layout)
+        return;
+    if (im->c > 1)
+    {
+        image converted = to_layout(*im, layout);
+        free_image(*im);
+        *im = converted;
+    }
+    // one channel is the same in either layout
+    im->layout = layout;
+}
+
+image rgb_to_grayscale(image im)
+{
+    assert(im.c == 3);
+    // make an empty image with 1 channel
+    image gray = make_image(im.w, im.h, 1);
+
+    // loop over every pixel and set RGB values to greyscale
+    rgb_to_grayscale_view(view_image(im), view_image(gray));
     return gray;
 }
 
-void shift_image(image im, int c, float v)
+// shift_image, scale_image, clamp_image and the color conversions all
+// go through one pointwise pipeline, see make_pointwise. Each op works
+// on a block of pixels at a time, one contiguous run per channel, so
+// chains of ops make one pass over memory and their inner loops are
+// simple enough to vectorize. Running an op alone is the eager version
+// of it, which makes fused results identical to eager ones by design.
+
+#define POINTWISE_SHIFT 0
+#define POINTWISE_SCALE 1
+#define POINTWISE_CLAMP 2
+#define POINTWISE_RGB_TO_HSV 3
+#define POINTWISE_HSV_TO_RGB 4
+
+// Pixels per block, small enough for every channel to stay in L1.
+#define POINTWISE_BLOCK 256
+
+void shift_block(float *p, int n, float v)
 {
-    // loop over every pixel
-    for (int x = 0; x < im.w; x++)
+    for (int i = 0; i < n; i++)
+        p[i] += v;
+}
+
+void scale_block(float *p, int n, float v)
+{
+    for (int i = 0; i < n; i++)
+        p[i] *= v;
+}
+
+void clamp_block(float *p, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        // any value below zero gets set to zero
+        // and any value above 1 gets set to one.
+        float v = p[i];
+        v = v > 1.0 ? 1.0 : v;
+        v = v < 0.0 ? 0.0 : v;
+        p[i] = v;
+    }
+}
+
+void rgb_to_hsv_block(float *r, float *g, float *b, int n);
+void hsv_to_rgb_block(float *h, float *s, float *v, int n);
+
+// An empty pipeline, add ops with pointwise_shift and friends and run
+// them with run_pointwise. Ops run in the order they were added.
+pointwise make_pointwise()
+{
+    pointwise p;
+    p.n = 0;
+    return p;
+}
+
+void add_pointwise_op(pointwise *p, int op, int c, float v)
+{
+    assert(p->n < POINTWISE_MAX_OPS);
+    p->ops[p->n].op = op;
+    p->ops[p->n].c = c;
+    p->ops[p->n].v = v;
+    p->n++;
+}
+
+// Records shift_image(im, c, v).
+void pointwise_shift(pointwise *p, int c, float v)
+{
+    add_pointwise_op(p, POINTWISE_SHIFT, c, v);
+}
+
+// Records scale_image(im, c, v).
+void pointwise_scale(pointwise *p, int c, float v)
+{
+    add_pointwise_op(p, POINTWISE_SCALE, c, v);
+}
+
+// Records clamp_image(im).
+void pointwise_clamp(pointwise *p)
+{
+    add_pointwise_op(p, POINTWISE_CLAMP, 0, 0);
+}
+
+// Records rgb_to_hsv(im).
+void pointwise_rgb_to_hsv(pointwise *p)
+{
+    add_pointwise_op(p, POINTWISE_RGB_TO_HSV, 0, 0);
+}
+
+// Records hsv_to_rgb(im).
+void pointwise_hsv_to_rgb(pointwise *p)
+{
+    add_pointwise_op(p, POINTWISE_HSV_TO_RGB, 0, 0);
+}
+
+// Applies one op to a block.
+// float **ch: the block of each channel.
+// int nc: number of channels.
+// int n: pixels in the block.
+void apply_pointwise_op(pointwise_op op, float **ch, int nc, int n)
+{
+    switch (op.op)
+    {
+    case POINTWISE_SHIFT:
+        shift_block(ch[op.c], n, op.v);
+        break;
+    case POINTWISE_SCALE:
+        scale_block(ch[op.c], n, op.v);
+        break;
+    case POINTWISE_CLAMP:
+        for (int c = 0; c < nc; c++)
+            clamp_block(ch[c], n);
+        break;
+    case POINTWISE_RGB_TO_HSV:
+        rgb_to_hsv_block(ch[0], ch[1], ch[2], n);
+        break;
+    case POINTWISE_HSV_TO_RGB:
+        hsv_to_rgb_block(ch[0], ch[1], ch[2], n);
+        break;
+    }
+}
+
+// Arguments of run_pointwise_view for parallel_for.
+typedef struct{
+    image_view im;
+    const pointwise *p;
+} pointwise_job;
+
+// Rows y0 .. y1 - 1 of run_pointwise_view. Planar views are worked on
+// in place, interleaved ones through a gathered copy of each block.
+void pointwise_rows(void *ctx, int y0, int y1)
+{
+    pointwise_job *job = ctx;
+    image_view im = job->im;
+    float **ch = calloc(im.c, sizeof(float *));
+    float *buf = im.xstride == 1 ? 0 : malloc((size_t)im.c * POINTWISE_BLOCK * sizeof(float));
+    for (int y = y0; y < y1; y++)
     {
-        for (int y = 0; y < im.h; y++)
+        for (int x0 = 0; x0 < im.w; x0 += POINTWISE_BLOCK)
         {
-            // get and set value of pixel
-            float pixel_value = get_pixel(im, x, y, c);
-            set_pixel(im, x, y, c, pixel_value + v);
+            int n = MIN(POINTWISE_BLOCK, im.w - x0);
+            for (int c = 0; c < im.c; c++)
+            {
+                float *p = view_at(im, x0, y, c);
+                if (buf)
+                {
+                    ch[c] = buf + c * POINTWISE_BLOCK;
+                    for (int i = 0; i < n; i++)
+                        ch[c][i] = p[i * im.xstride];
+                }
+                else
+                    ch[c] = p;
+            }
+            for (int k = 0; k < job->p->n; k++)
+                apply_pointwise_op(job->p->ops[k], ch, im.c, n);
+            if (buf)
+                for (int c = 0; c < im.c; c++)
+                {
+                    float *p = view_at(im, x0, y, c);
+                    for (int i = 0; i < n; i++)
+                        p[i * im.xstride] = ch[c][i];
+                }
         }
     }
+    free(buf);
+    free(ch);
+}
+
+// Runs a pipeline over a view in place, in one pass over its pixels.
+// The result is what calling the recorded ops one after the other
+// would give, bit for bit.
+void run_pointwise_view(const pointwise *p, image_view im)
+{
+    double cost = 0;
+    for (int k = 0; k < p->n; k++)
+    {
+        pointwise_op op = p->ops[k];
+        if (op.op == POINTWISE_SHIFT || op.op == POINTWISE_SCALE)
+            assert(op.c >= 0 && op.c < im.c);
+        if (op.op == POINTWISE_RGB_TO_HSV || op.op == POINTWISE_HSV_TO_RGB)
+            assert(im.c == 3);
+        cost += op.op == POINTWISE_CLAMP ? 2 * im.c : op.op == POINTWISE_SHIFT || op.op == POINTWISE_SCALE ? 1 : 30;
+    }
+    if (p->n == 0)
+        return;
+    pointwise_job job = {im, p};
+    parallel_for(im.h, parallel_grain(cost * im.w), pointwise_rows, &job);
+}
+
+void run_pointwise(const pointwise *p, image im)
+{
+    run_pointwise_view(p, view_image(im));
+}
+
+// Runs a single op over a view, the eager form of the kernels below.
+void run_pointwise_op(image_view im, int op, int c, float v)
+{
+    pointwise p = make_pointwise();
+    add_pointwise_op(&p, op, c, v);
+    run_pointwise_view(&p, im);
+}
+
+// Adds v to channel c of a view.
+void shift_view(image_view im, int c, float v)
+{
+    run_pointwise_op(im, POINTWISE_SHIFT, c, v);
+}
+
+// Multiplies channel c of a view by v.
+void scale_view(image_view im, int c, float v)
+{
+    run_pointwise_op(im, POINTWISE_SCALE, c, v);
+}
+
+void shift_image(image im, int c, float v)
+{
+    // loop over every pixel
+    shift_view(view_image(im), c, v);
+}
+
+void scale_image(image im, int c, float v)
+{
+    scale_view(view_image(im), c, v);
+}
+
+// clamp_image for views.
+void clamp_view(image_view im)
+{
+    run_pointwise_op(im, POINTWISE_CLAMP, 0, 0);
 }
 
 void clamp_image(image im)
@@ -109,171 +444,269 @@ void clamp_image(image im)
     * to avoid overflow
     * make sure the pixel values in the image stay between 0 and 1.
     */
-    for (int c = 0; c < im.c; c++)
+    clamp_view(view_image(im));
+}
+
+// The color conversions are written without branches: every choice
+// is a select between values computed for all pixels, which the
+// compiler turns into blends, so the loops vectorize and run a whole
+// vector of pixels per instruction.
+
+// rgb_to_hsv of a block, one run of pixels per channel, in place.
+void rgb_to_hsv_block(float *r, float *g, float *b, int n)
+{
+    for (int i = 0; i < n; i++)
     {
-        for (int h = 0; h < im.h; h++)
-        {
-            for (int w = 0; w < im.w; w++)
-            {
-                // get pixel value
-                float v = get_pixel(im, w, h, c);
-
-                // any value below zero gets set to zero
-                // and any value above 1 gets set to one.
-                v = v > 1.0 ? 1.0 : v;
-                v = v < 0.0 ? 0.0 : v;
-                set_pixel(im, w, h, c, v);
-            }
-        }
+        float R = r[i];
+        float G = g[i];
+        float B = b[i];
+
+        // value is the largest channel, chroma its distance to the smallest
+        float V = fmaxf(fmaxf(R, G), B);
+        float m = fminf(fminf(R, G), B);
+        float C = V - m;
+
+        float S = V > 0 ? C / V : 0;
+
+        // hue sector of the largest channel, blue over green over red on ties
+        float safe = C != 0 ? C : 1;
+        float H_hatch = V == B ? (R - G) / safe + 4
+                        : V == G ? (B - R) / safe + 2
+                                 : (G - B) / safe;
+        float H = H_hatch / 6.f;
+        H = H_hatch < 0 ? H + 1 : H;
+        H = C != 0 ? H : 0;
+
+        r[i] = H;
+        g[i] = S;
+        b[i] = V;
     }
 }
 
-float three_way_max(float a, float b, float c)
+// rgb_to_hsv for views, in place.
+void rgb_to_hsv_view(image_view im)
 {
-    return (a > b) ? ((a > c) ? a : c) : ((b > c) ? b : c);
+    run_pointwise_op(im, POINTWISE_RGB_TO_HSV, 0, 0);
 }
 
-float three_way_min(float a, float b, float c)
+void rgb_to_hsv(image im)
 {
-    return (a < b) ? ((a < c) ? a : c) : ((b < c) ? b : c);
+    rgb_to_hsv_view(view_image(im));
 }
 
-float compute_value(float R, float G, float B)
+// One channel of hsv_to_rgb, n = 5 for red, 3 for green and 1 for blue.
+// The channel is V - C * clamp(min(k, 4 - k), 0, 1) with k = n + 6H
+// taken mod 6, which traces the six sectors of the hexcone.
+static inline float hsv_channel(float n, float H_, float V, float C)
 {
-    return three_way_max(R, G, B);
+    float k = n + H_;
+    k = k >= 6 ? k - 6 : k;
+    float t = fminf(fminf(k, 4 - k), 1);
+    return V - C * fmaxf(t, 0);
 }
-float compute_saturation(float V, float R, float G, float B)
+
+// hsv_to_rgb of a block, one run of pixels per channel, in place.
+void hsv_to_rgb_block(float *h, float *s, float *v, int n)
 {
-    float m = three_way_min(R, G, B);
-    float C = V - m;
-    if (V > 0)
-    {
-        return C / V;
-    }
-    else
+    for (int i = 0; i < n; i++)
     {
-        return 0;
+        float V = v[i];
+        float C = s[i] * V;
+        float H_ = h[i] * 6.f;
+
+        // hues outside 0 .. 1 have no sector, they give gray at V - C
+        int valid = H_ >= 0 && H_ <= 6;
+        float R = hsv_channel(5, H_, V, C);
+        float G = hsv_channel(3, H_, V, C);
+        float B = hsv_channel(1, H_, V, C);
+        h[i] = valid ? R : V - C;
+        s[i] = valid ? G : V - C;
+        v[i] = valid ? B : V - C;
     }
 }
 
-float compute_hue(float V, float R, float G, float B)
+// hsv_to_rgb for views, in place.
+void hsv_to_rgb_view(image_view im)
+{
+    run_pointwise_op(im, POINTWISE_HSV_TO_RGB, 0, 0);
+}
+
+void hsv_to_rgb(image im)
+{
+    hsv_to_rgb_view(view_image(im));
+}
+
+// Nearest half float to a float, ties to even. Out of range values
+// become infinity, tiny ones denormals or zero.
+unsigned short float_to_half(float f)
 {
-    float H;
-    float m = three_way_min(R, G, B);
-    float C = V - m;
-    float H_hatch = 0;
-    if (C == 0)
+    unsigned int x;
+    memcpy(&x, &f, sizeof(x));
+    unsigned short sign = (x >> 16) & 0x8000;
+    unsigned int mag = x & 0x7fffffff;
+    if (mag >= 0x7f800000)
+        return sign | 0x7c00 | (mag > 0x7f800000 ? 0x200 : 0);
+    if (mag >= 0x477ff000)
+        return sign | 0x7c00;
+    if (mag < 0x38800000)
     {
-        H = 0;
+        // denormal: shift the mantissa, implicit bit included, into place
+        if (mag < 0x33000000)
+            return sign;
+        int shift = 126 - (mag >> 23);
+        unsigned int m = (mag & 0x7fffff) | 0x800000;
+        unsigned int h = m >> shift;
+        unsigned int rest = m & ((1u << shift) - 1);
+        unsigned int half = 1u << (shift - 1);
+        if (rest > half || (rest == half && (h & 1)))
+            h++;
+        return sign | h;
     }
+    // rebias the exponent and round away 13 mantissa bits
+    unsigned int h = (mag - 0x38000000) >> 13;
+    unsigned int rest = mag & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        h++;
+    return sign | h;
+}
+
+// The float a half float stands for, exactly.
+float half_to_float(unsigned short h)
+{
+    unsigned int sign = (unsigned int)(h & 0x8000) << 16;
+    unsigned int exp = (h >> 10) & 0x1f;
+    unsigned int m = h & 0x3ff;
+    unsigned int x;
+    if (exp == 0x1f)
+        x = sign | 0x7f800000 | (m << 13);
+    else if (exp)
+        x = sign | ((exp + 112) << 23) | (m << 13);
     else
     {
-        if (V == R)
-            H_hatch = (G - B) / C;
-        if (V == G)
-            H_hatch = (B - R) / C + 2;
-        if (V == B)
-            H_hatch = (R - G) / C + 4;
-        H = H_hatch / 6.;
-        if (H_hatch < 0)
-            H = H + 1;
+        // denormal or zero, m * 2^-24
+        float f = m * 0x1p-24f;
+        return sign ? -f : f;
     }
-    return H;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
 }
 
-void rgb_to_hsv(image im)
+// Arguments of the storage conversions for parallel_for, each of
+// which runs over the c * h rows of a packed image.
+typedef struct{
+    image_view im;
+    void *out;
+} convert_job;
+
+// Rows of image_to_u8.
+void to_u8_rows(void *ctx, int r0, int r1)
 {
-    for (int y = 0; y < im.h; y++)
+    convert_job *job = ctx;
+    image_view im = job->im;
+    for (int r = r0; r < r1; r++)
     {
+        const float *p = view_at(im, 0, r % im.h, r / im.h);
+        unsigned char *out = (unsigned char *)job->out + (size_t)r * im.w;
         for (int x = 0; x < im.w; x++)
         {
-            // get pixel values
-            float R = get_pixel(im, x, y, 0);
-            float G = get_pixel(im, x, y, 1);
-            float B = get_pixel(im, x, y, 2);
+            float v = p[x * im.xstride] * 255 + .5f;
+            out[x] = v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
+        }
+    }
+}
 
-            // compute Value
-            float V = compute_value(R, G, B);
+// Rows of u8_to_image.
+void from_u8_rows(void *ctx, int r0, int r1)
+{
+    convert_job *job = ctx;
+    const unsigned char *in = job->out;
+    float *out = job->im.data;
+    for (size_t i = (size_t)r0 * job->im.w; i < (size_t)r1 * job->im.w; i++)
+        out[i] = (float)in[i] / 255.;
+}
 
-            // compute Saturation
-            float S = compute_saturation(V, R, G, B);
+// Rows of image_to_f16.
+void to_f16_rows(void *ctx, int r0, int r1)
+{
+    convert_job *job = ctx;
+    image_view im = job->im;
+    for (int r = r0; r < r1; r++)
+    {
+        const float *p = view_at(im, 0, r % im.h, r / im.h);
+        unsigned short *out = (unsigned short *)job->out + (size_t)r * im.w;
+        for (int x = 0; x < im.w; x++)
+            out[x] = float_to_half(p[x * im.xstride]);
+    }
+}
 
-            // compute Hue
-            float H = compute_hue(V, R, G, B);
+// Rows of f16_to_image.
+void from_f16_rows(void *ctx, int r0, int r1)
+{
+    convert_job *job = ctx;
+    const unsigned short *in = job->out;
+    float *out = job->im.data;
+    for (size_t i = (size_t)r0 * job->im.w; i < (size_t)r1 * job->im.w; i++)
+        out[i] = half_to_float(in[i]);
+}
 
-            // set pixels
-            set_pixel(im, x, y, 0, H);
-            set_pixel(im, x, y, 1, S);
-            set_pixel(im, x, y, 2, V);
-        }
-    }
+// Converts an image of any layout to 8 bits, clamped to 0 .. 1 and
+// rounded to the nearest of the 256 levels.
+image_u8 image_to_u8(image im)
+{
+    image_u8 out = make_image_u8(im.w, im.h, im.c);
+    convert_job job = {view_image(im), out.data};
+    parallel_for(im.h * im.c, parallel_grain(4. * im.w), to_u8_rows, &job);
+    return out;
 }
 
-void hsv_to_rgb(image im)
+// Expands an 8 bit image to floats, the same values load_image gives.
+image u8_to_image(image_u8 im)
 {
-    float R, G, B;
-    for (int h = 0; h < im.h; h++)
-    {
-        for (int w = 0; w < im.w; w++)
-        {
-            float H = get_pixel(im, w, h, 0);
-            float S = get_pixel(im, w, h, 1);
-            float V = get_pixel(im, w, h, 2);
+    image out = make_image_uninit(im.w, im.h, im.c);
+    convert_job job = {view_image(out), im.data};
+    parallel_for(im.h * im.c, parallel_grain(2. * im.w), from_u8_rows, &job);
+    return out;
+}
 
-            float C = S * V;
-            float m = V - C;
+// Converts an image of any layout to half floats, rounded to nearest.
+image_f16 image_to_f16(image im)
+{
+    image_f16 out = make_image_f16(im.w, im.h, im.c);
+    convert_job job = {view_image(im), out.data};
+    parallel_for(im.h * im.c, parallel_grain(10. * im.w), to_f16_rows, &job);
+    return out;
+}
 
-            float H_ = H * 6.;
-            float X = C * (1 - fabs(fmod(H_, 2) - 1));
+image f16_to_image(image_f16 im)
+{
+    image out = make_image_uninit(im.w, im.h, im.c);
+    convert_job job = {view_image(out), im.data};
+    parallel_for(im.h * im.c, parallel_grain(8. * im.w), from_f16_rows, &job);
+    return out;
+}
 
-            if (0. <= H_ && H_ <= 1.)
-            {
-                R = C;
-                G = X;
-                B = 0;
-            }
-            else if (1. <= H_ && H_ <= 2.)
-            {
-                R = X;
-                G = C;
-                B = 0;
-            }
-            else if (2. <= H_ && H_ <= 3.)
-            {
-                R = 0;
-                G = C;
-                B = X;
-            }
-            else if (3. <= H_ && H_ <= 4.)
-            {
-                R = 0;
-                G = X;
-                B = C;
-            }
-            else if (4. <= H_ && H_ <= 5.)
-            {
-                R = X;
-                G = 0;
-                B = C;
-            }
-            else if (5. <= H_ && H_ <= 6.)
-            {
-                R = C;
-                G = 0;
-                B = X;
-            }
-            else
-            {
-                R = 0;
-                G = 0;
-                B = 0;
-            }
-            R = R + m;
-            G = G + m;
-            B = B + m;
-            set_pixel(im, w, h, 0, R);
-            set_pixel(im, w, h, 1, G);
-            set_pixel(im, w, h, 2, B);
-        }
+// Rows y0 .. y1 - 1 of rgb_to_grayscale_u8.
+void rgb_to_grayscale_u8_rows(void *ctx, int y0, int y1)
+{
+    image_u8 *ims = ctx;
+    image_u8 im = ims[0];
+    image_u8 gray = ims[1];
+    size_t plane = (size_t)im.w * im.h;
+    for (size_t i = (size_t)y0 * im.w; i < (size_t)y1 * im.w; i++)
+    {
+        // the luma weights of rgb_to_grayscale in 8 bit fixed point,
+        // 77 + 150 + 29 = 256
+        int R = im.data[i], G = im.data[i + plane], B = im.data[i + 2 * plane];
+        gray.data[i] = (77 * R + 150 * G + 29 * B + 128) >> 8;
     }
 }
+
+// rgb_to_grayscale on 8 bit data, within one level of the float version.
+image_u8 rgb_to_grayscale_u8(image_u8 im)
+{
+    assert(im.c == 3);
+    image_u8 ims[2] = {im, make_image_u8(im.w, im.h, 1)};
+    parallel_for(im.h, parallel_grain(4. * im.w), rgb_to_grayscale_u8_rows, ims);
+    return ims[1];
+}
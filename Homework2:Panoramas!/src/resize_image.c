@@ -1,5 +1,16 @@
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <assert.h>
 #include "image.h"
+#include "parallel.h"
+#define PI 3.14159265358979
+
+// Arguments of the resize kernels for parallel_for.
+typedef struct{
+    image im;
+    image resized;
+} resize_job;
 
 float nn_interpolate(image im, float x, float y, int c)
 {
@@ -8,10 +19,13 @@ float nn_interpolate(image im, float x, float y, int c)
     return get_pixel(im, round(x), round(y), c);
 }
 
-image nn_resize(image im, int w, int h)
+// Output rows y0 .. y1 - 1 of nn_resize.
+void nn_resize_rows(void *ctx, int y0, int y1)
 {
-    // create new image
-    image resized_im = make_image(w, h, im.c);
+    resize_job *job = ctx;
+    image im = job->im;
+    int w = job->resized.w;
+    int h = job->resized.h;
 
     // match up cooardinates
     // given two points (-0.5, -0.5) & (new_w, new_h)
@@ -25,21 +39,27 @@ image nn_resize(image im, int w, int h)
     float by = 0.5 * ay - 0.5;
 
     // iterate over new points and map to old coords
-    for (int x = 0; x < w; x++)
+    for (int y = y0; y < y1; y++)
     {
-        for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
         {
             for (int c = 0; c < im.c; c++)
             {
                 float old_x = x * ax + bx;
                 float old_y = y * ay + by;
                 float interpolated_value = nn_interpolate(im, old_x, old_y, c);
-                set_pixel(resized_im, x, y, c, interpolated_value);
+                set_pixel(job->resized, x, y, c, interpolated_value);
             }
         }
     }
+}
 
-    return resized_im;
+image nn_resize(image im, int w, int h)
+{
+    // create new image
+    resize_job job = {im, make_image_layout(w, h, im.c, im.layout)};
+    parallel_for(h, parallel_grain(4. * w * im.c), nn_resize_rows, &job);
+    return job.resized;
 }
 
 float bilinear_interpolate(image im, float x, float y, int c)
@@ -47,10 +67,12 @@ float bilinear_interpolate(image im, float x, float y, int c)
     // https://github.com/raytroop/CSE455-Homework/blob/master/vision-hw1/src/resize_image.c
 
     // get the coordinates of the box surrounding the interpolated value q
+    // right and bottom are one past, not ceil: on a whole pixel
+    // position ceil would equal floor and every weight would be 0
     int left = floorf(x);
-    int right = ceilf(x);
+    int right = left + 1;
     int top = floorf(y);
-    int bottom = ceilf(y);
+    int bottom = top + 1;
 
     // get the pixel value of the 4 nearby pixels
     float v1 = get_pixel(im, left, top, c);
@@ -72,36 +94,603 @@ float bilinear_interpolate(image im, float x, float y, int c)
     return q;
 }
 
+// Precomputed resampling weights along one axis. Output sample i is
+// sum over k of weight[i * taps + k] * input[index[i * taps + k]].
+// int n: number of output samples.
+// int taps: weights per output sample.
+// int *index: n * taps input positions, already clamped to the input.
+// float *weight: n * taps weights.
+typedef struct{
+    int n, taps;
+    int *index;
+    float *weight;
+} resample_axis;
+
+resample_axis make_resample_axis(int n, int taps)
+{
+    resample_axis axis;
+    axis.n = n;
+    axis.taps = taps;
+    axis.index = calloc((size_t)n * taps, sizeof(int));
+    axis.weight = calloc((size_t)n * taps, sizeof(float));
+    return axis;
+}
+
+void free_resample_axis(resample_axis axis)
+{
+    free(axis.index);
+    free(axis.weight);
+}
+
+// Linear interpolation weights for resizing an axis of length in to out,
+// with the same pixel center mapping as bilinear_interpolate.
+resample_axis bilinear_axis(int in, int out)
+{
+    resample_axis axis = make_resample_axis(out, 2);
+    float a = (float)in / out;
+    float b = 0.5 * a - 0.5;
+    for (int i = 0; i < out; i++)
+    {
+        float x = i * a + b;
+        int left = floorf(x);
+        axis.index[2 * i] = clamp_padding(left, 0, in);
+        axis.index[2 * i + 1] = clamp_padding(left + 1, 0, in);
+        axis.weight[2 * i] = left + 1 - x;
+        axis.weight[2 * i + 1] = x - left;
+    }
+    return axis;
+}
+
+// Arguments of the two passes of resample_view for parallel_for.
+typedef struct{
+    image_view im;
+    float *tmp;
+    image_view resized;
+    resample_axis xs, ys;
+} resample_job;
+
+// Horizontal pass over input rows r0 .. r1 - 1, channels stacked.
+void resample_rows(void *ctx, int r0, int r1)
+{
+    resample_job *job = ctx;
+    int w = job->xs.n;
+    int taps = job->xs.taps;
+    int xs = job->im.xstride;
+    for (int r = r0; r < r1; r++)
+    {
+        const float *in = view_at(job->im, 0, r % job->im.h, r / job->im.h);
+        float *out = job->tmp + (size_t)r * w;
+        for (int x = 0; x < w; x++)
+        {
+            const int *index = job->xs.index + x * taps;
+            const float *weight = job->xs.weight + x * taps;
+            float sum = 0;
+            for (int k = 0; k < taps; k++)
+                sum += in[index[k] * xs] * weight[k];
+            out[x] = sum;
+        }
+    }
+}
+
+// Vertical pass over output rows r0 .. r1 - 1, channels stacked.
+// Each output row is a weighted sum of whole intermediate rows.
+void resample_cols(void *ctx, int r0, int r1)
+{
+    resample_job *job = ctx;
+    int w = job->xs.n;
+    int h = job->ys.n;
+    int taps = job->ys.taps;
+    image_view resized = job->resized;
+    float *out = resized.xstride == 1 ? 0 : calloc(w, sizeof(float));
+    for (int r = r0; r < r1; r++)
+    {
+        int c = r / h;
+        int y = r % h;
+        // strided outputs are summed in a row buffer and scattered after
+        float *dst = view_at(resized, 0, y, c);
+        if (resized.xstride == 1)
+            out = dst;
+        for (int x = 0; x < w; x++)
+            out[x] = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            const float *in = job->tmp + ((size_t)c * job->im.h + job->ys.index[y * taps + k]) * w;
+            float weight = job->ys.weight[y * taps + k];
+            for (int x = 0; x < w; x++)
+                out[x] += in[x] * weight;
+        }
+        if (resized.xstride != 1)
+            for (int x = 0; x < w; x++)
+                dst[x * resized.xstride] = out[x];
+    }
+    if (resized.xstride != 1)
+        free(out);
+}
+
+// Resamples a view with precomputed per-column and per-row weights:
+// a horizontal pass into a xs.n x im.h buffer, then a vertical pass
+// whose inner loop runs over contiguous rows.
+// resample_axis xs, ys: weights along x and y.
+// image_view resized: xs.n x ys.n output with the channels of im.
+void resample_view(image_view im, resample_axis xs, resample_axis ys, image_view resized)
+{
+    assert(resized.w == xs.n && resized.h == ys.n && resized.c == im.c);
+    resample_job job;
+    job.im = im;
+    job.tmp = calloc((size_t)xs.n * im.h * im.c, sizeof(float));
+    job.resized = resized;
+    job.xs = xs;
+    job.ys = ys;
+    parallel_for(im.h * im.c, parallel_grain(2. * xs.n * xs.taps), resample_rows, &job);
+    parallel_for(ys.n * im.c, parallel_grain(2. * xs.n * ys.taps), resample_cols, &job);
+    free(job.tmp);
+}
+
+// resample_view into a new image.
+image resample_image(image im, resample_axis xs, resample_axis ys)
+{
+    image resized = make_image_uninit(xs.n, ys.n, im.c);
+    resized.layout = im.layout;
+    resample_view(view_image(im), xs, ys, view_image(resized));
+    return resized;
+}
+
 image bilinear_resize(image im, int w, int h)
 {
-    // create new image
-    image resized_im = make_image(w, h, im.c);
+    resample_axis xs = bilinear_axis(im.w, w);
+    resample_axis ys = bilinear_axis(im.h, h);
+    image resized = resample_image(im, xs, ys);
+    free_resample_axis(xs);
+    free_resample_axis(ys);
+    return resized;
+}
 
-    // match up cooardinates
-    // given two points (-0.5, -0.5) & (new_w, new_h)
-    // find aX + b = Y coeffiecents
+// Keys cubic with a = -0.5, the usual bicubic kernel. Support 2.
+float bicubic_kernel(float x)
+{
+    x = fabsf(x);
+    if (x < 1)
+        return (1.5 * x - 2.5) * x * x + 1;
+    if (x < 2)
+        return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+    return 0;
+}
 
-    // x coeffiecents
-    float ax = (float)im.w / w;
-    float bx = 0.5 * ax - 0.5;
-    // y coeffiecents
-    float ay = (float)im.h / h;
-    float by = 0.5 * ay - 0.5;
+// Lanczos window of 3 lobes, sinc(x) sinc(x / 3). Support 3.
+float lanczos3_kernel(float x)
+{
+    x = fabsf(x);
+    if (x < 1e-6)
+        return 1;
+    if (x >= 3)
+        return 0;
+    double px = PI * x;
+    return 3 * sin(px) * sin(px / 3) / (px * px);
+}
 
-    // iterate over new points and map to old coords
-    for (int x = 0; x < w; x++)
+float triangle_kernel(float x)
+{
+    x = fabsf(x);
+    return x < 1 ? 1 - x : 0;
+}
+
+// Resampling weights for one of the resize_image filters.
+// On minification the kernel is stretched by in / out, so every input
+// pixel contributes and nothing aliases. On magnification it is used
+// as is. Area weights are the exact overlap of each input pixel with
+// the output pixel's footprint, a box as wide as the larger of the
+// two pixels. Weights are normalized to sum to 1, edges are clamped.
+// int in, out: length of the axis before and after.
+// int filter: one of the RESIZE_ defines.
+resample_axis filter_axis(int in, int out, int filter)
+{
+    float (*kernel)(float) = filter == RESIZE_BICUBIC ? bicubic_kernel
+                             : filter == RESIZE_LANCZOS3 ? lanczos3_kernel
+                                                         : triangle_kernel;
+    float support = filter == RESIZE_BICUBIC ? 2 : filter == RESIZE_LANCZOS3 ? 3 : 1;
+    double a = (double)in / out;
+    double stretch = MAX(a, 1.);
+    double radius = filter == RESIZE_AREA ? stretch / 2 : support * stretch;
+    int taps = ceil(2 * radius) + 1;
+
+    resample_axis axis = make_resample_axis(out, taps);
+    for (int i = 0; i < out; i++)
     {
-        for (int y = 0; y < h; y++)
+        // same center mapping as bilinear_resize
+        double x = (i + 0.5) * a - 0.5;
+        int first = ceil(x - radius - (filter == RESIZE_AREA ? 0.5 : 0));
+        int *index = axis.index + i * taps;
+        float *weight = axis.weight + i * taps;
+        double total = 0;
+        for (int k = 0; k < taps; k++)
         {
-            for (int c = 0; c < im.c; c++)
+            int j = first + k;
+            double w;
+            if (filter == RESIZE_AREA)
+                w = MAX(0., MIN(j + 0.5, x + radius) - MAX(j - 0.5, x - radius));
+            else
+                w = kernel((j - x) / stretch);
+            index[k] = clamp_padding(j, 0, in);
+            weight[k] = w;
+            total += w;
+        }
+        for (int k = 0; k < taps; k++)
+            weight[k] /= total;
+    }
+    return axis;
+}
+
+// resize_image from one view into another, e.g. a tile of a larger
+// image into a tile of a thumbnail. The output size is out's size.
+void resize_view(image_view im, image_view out, int filter)
+{
+    assert(filter >= RESIZE_BILINEAR && filter <= RESIZE_LANCZOS3 && out.c == im.c);
+    resample_axis xs = filter_axis(im.w, out.w, filter);
+    resample_axis ys = filter_axis(im.h, out.h, filter);
+    resample_view(im, xs, ys, out);
+    free_resample_axis(xs);
+    free_resample_axis(ys);
+}
+
+// Resizes an image with an antialiasing resampling filter. When
+// shrinking, the filter support widens with the scale factor, so a
+// single call does what a blur followed by a resize would.
+// image im: image to resize.
+// int w, h: output size.
+// int filter: RESIZE_BILINEAR (triangle), RESIZE_AREA (box average),
+//             RESIZE_BICUBIC (Keys, a = -0.5) or RESIZE_LANCZOS3.
+// returns: the resized image.
+image resize_image(image im, int w, int h, int filter)
+{
+    image resized = make_image_uninit(w, h, im.c);
+    resized.layout = im.layout;
+    resize_view(view_image(im), view_image(resized), filter);
+    return resized;
+}
+
+// Fraction bits of the fixed point weights of resize_u8, and of the
+// intermediate rows between its passes. Those are kept as shorts with
+// headroom for the overshoot of bicubic and Lanczos.
+#define RESIZE_U8_BITS 14
+#define RESIZE_U8_ROW_BITS 6
+
+// Rounds the weights of an axis to fixed point. Rounding errors go to
+// the largest weight of each sample, so every sample still sums to one
+// and flat areas stay flat.
+int *fixed_point_weights(resample_axis axis)
+{
+    int *q = calloc((size_t)axis.n * axis.taps, sizeof(int));
+    for (int i = 0; i < axis.n; i++)
+    {
+        const float *weight = axis.weight + i * axis.taps;
+        int *qi = q + i * axis.taps;
+        int total = 0, largest = 0;
+        for (int k = 0; k < axis.taps; k++)
+        {
+            qi[k] = lrintf(weight[k] * (1 << RESIZE_U8_BITS));
+            total += qi[k];
+            if (qi[k] > qi[largest])
+                largest = k;
+        }
+        qi[largest] += (1 << RESIZE_U8_BITS) - total;
+    }
+    return q;
+}
+
+// Arguments of the two passes of resize_u8 for parallel_for.
+typedef struct{
+    image_u8 im;
+    short *tmp;
+    image_u8 resized;
+    resample_axis xs, ys;
+    int *xq, *yq;
+} resize_u8_job;
+
+// Rounds a fixed point sum with the given fraction bits to 8 bits.
+static inline unsigned char round_fixed_u8(int sum, int bits)
+{
+    sum = (sum + (1 << (bits - 1))) >> bits;
+    return sum < 0 ? 0 : sum > 255 ? 255 : sum;
+}
+
+// Horizontal pass over input rows r0 .. r1 - 1, channels stacked.
+void resize_u8_rows(void *ctx, int r0, int r1)
+{
+    resize_u8_job *job = ctx;
+    int w = job->xs.n;
+    int taps = job->xs.taps;
+    for (int r = r0; r < r1; r++)
+    {
+        const unsigned char *in = job->im.data + (size_t)r * job->im.w;
+        short *out = job->tmp + (size_t)r * w;
+        for (int x = 0; x < w; x++)
+        {
+            const int *index = job->xs.index + x * taps;
+            const int *weight = job->xq + x * taps;
+            int sum = 0;
+            for (int k = 0; k < taps; k++)
+                sum += in[index[k]] * weight[k];
+            int shift = RESIZE_U8_BITS - RESIZE_U8_ROW_BITS;
+            out[x] = (sum + (1 << (shift - 1))) >> shift;
+        }
+    }
+}
+
+// Vertical pass over output rows r0 .. r1 - 1, channels stacked.
+void resize_u8_cols(void *ctx, int r0, int r1)
+{
+    resize_u8_job *job = ctx;
+    int w = job->xs.n;
+    int h = job->ys.n;
+    int taps = job->ys.taps;
+    int *sum = calloc(w, sizeof(int));
+    for (int r = r0; r < r1; r++)
+    {
+        int c = r / h;
+        int y = r % h;
+        for (int x = 0; x < w; x++)
+            sum[x] = 0;
+        for (int k = 0; k < taps; k++)
+        {
+            const short *in = job->tmp + ((size_t)c * job->im.h + job->ys.index[y * taps + k]) * w;
+            int weight = job->yq[y * taps + k];
+            for (int x = 0; x < w; x++)
+                sum[x] += in[x] * weight;
+        }
+        unsigned char *out = job->resized.data + (size_t)r * w;
+        for (int x = 0; x < w; x++)
+            out[x] = round_fixed_u8(sum[x], RESIZE_U8_BITS + RESIZE_U8_ROW_BITS);
+    }
+    free(sum);
+}
+
+// resample_image for 8 bit images, with the weights rounded to 14 bit
+// fixed point and integer accumulators. Results are within a level of
+// the float version.
+image_u8 resample_u8(image_u8 im, resample_axis xs, resample_axis ys)
+{
+    resize_u8_job job;
+    job.im = im;
+    job.resized = make_image_u8(xs.n, ys.n, im.c);
+    job.xs = xs;
+    job.ys = ys;
+    job.xq = fixed_point_weights(xs);
+    job.yq = fixed_point_weights(ys);
+    job.tmp = malloc((size_t)xs.n * im.h * im.c * sizeof(short));
+    parallel_for(im.h * im.c, parallel_grain(2. * xs.n * xs.taps), resize_u8_rows, &job);
+    parallel_for(ys.n * im.c, parallel_grain(2. * xs.n * ys.taps), resize_u8_cols, &job);
+    free(job.tmp);
+    free(job.xq);
+    free(job.yq);
+    return job.resized;
+}
+
+// resize_image for 8 bit images.
+image_u8 resize_u8(image_u8 im, int w, int h, int filter)
+{
+    resample_axis xs = filter_axis(im.w, w, filter);
+    resample_axis ys = filter_axis(im.h, h, filter);
+    image_u8 resized = resample_u8(im, xs, ys);
+    free_resample_axis(xs);
+    free_resample_axis(ys);
+    return resized;
+}
+
+// Weights that blur an axis with a 1d filter and keep every other
+// sample: output i is the filter centered on input 2i, clamp padded.
+// int in: length of the axis, the output is (in + 1) / 2 long.
+// image g: the filter, an odd number of taps.
+resample_axis decimate_axis(int in, image g)
+{
+    int taps = g.w * g.h;
+    resample_axis axis = make_resample_axis((in + 1) / 2, taps);
+    for (int i = 0; i < axis.n; i++)
+    {
+        for (int k = 0; k < taps; k++)
+        {
+            axis.index[i * taps + k] = clamp_padding(2 * i + k - taps / 2, 0, in);
+            axis.weight[i * taps + k] = g.data[k];
+        }
+    }
+    return axis;
+}
+
+// Blurs an image with a gaussian and halves it, keeping the even pixels.
+// The blur is only evaluated where a pixel is kept, so this is much
+// cheaper than smooth_image followed by decimation. Below sigma 8, where
+// smooth_image uses the same gaussian kernel, the values are the same;
+// above it smooth_image switches to a recursive filter and they differ
+// slightly.
+// image im: image to reduce.
+// float sigma: std dev. of the gaussian.
+// image out: (im.w + 1) / 2 x (im.h + 1) / 2 output with the channels of im.
+void pyramid_down_into(image im, float sigma, image out)
+{
+    image g = make_1d_gaussian(sigma);
+    resample_axis xs = decimate_axis(im.w, g);
+    resample_axis ys = decimate_axis(im.h, g);
+    resample_view(view_image(im), xs, ys, view_image(out));
+    free_resample_axis(xs);
+    free_resample_axis(ys);
+    free_image(g);
+}
+
+// Weights that blur an axis with a 1d filter, clamp padded.
+resample_axis blur_axis(int in, image g)
+{
+    int taps = g.w * g.h;
+    resample_axis axis = make_resample_axis(in, taps);
+    for (int i = 0; i < in; i++)
+    {
+        for (int k = 0; k < taps; k++)
+        {
+            axis.index[i * taps + k] = clamp_padding(i + k - taps / 2, 0, in);
+            axis.weight[i * taps + k] = g.data[k];
+        }
+    }
+    return axis;
+}
+
+// smooth_image for 8 bit images, with fixed point weights and
+// integer accumulators, see resample_u8.
+image_u8 gaussian_blur_u8(image_u8 im, float sigma)
+{
+    image g = make_1d_gaussian(sigma);
+    resample_axis xs = blur_axis(im.w, g);
+    resample_axis ys = blur_axis(im.h, g);
+    image_u8 blurred = resample_u8(im, xs, ys);
+    free_resample_axis(xs);
+    free_resample_axis(ys);
+    free_image(g);
+    return blurred;
+}
+
+// Arguments of the two passes of box_blur_u8 for parallel_for.
+typedef struct{
+    image_u8 im;
+    int *tmp;
+    int w;
+    unsigned int recip;
+    image_u8 out;
+} box_u8_job;
+
+// Horizontal window sums of rows r0 .. r1 - 1, channels stacked. The
+// window slides: one pixel comes in and one goes out per step.
+void box_u8_rows(void *ctx, int r0, int r1)
+{
+    box_u8_job *job = ctx;
+    int w = job->im.w;
+    int left = job->w / 2, right = job->w - left - 1;
+    for (int r = r0; r < r1; r++)
+    {
+        const unsigned char *in = job->im.data + (size_t)r * w;
+        int *out = job->tmp + (size_t)r * w;
+        int sum = 0;
+        for (int i = -left; i <= right; i++)
+            sum += in[clamp_padding(i, 0, w)];
+        for (int x = 0; x < w; x++)
+        {
+            out[x] = sum;
+            sum += in[clamp_padding(x + right + 1, 0, w)] - in[clamp_padding(x - left, 0, w)];
+        }
+    }
+}
+
+// Vertical window sums and the division of rows r0 .. r1 - 1, channels
+// stacked. A chunk sums its first window in full and slides from there.
+void box_u8_cols(void *ctx, int r0, int r1)
+{
+    box_u8_job *job = ctx;
+    int w = job->im.w, h = job->im.h;
+    int top = job->w / 2, bottom = job->w - top - 1;
+    int *sum = calloc(w, sizeof(int));
+    for (int r = r0; r < r1; r++)
+    {
+        int c = r / h;
+        int y = r % h;
+        const int *plane = job->tmp + (size_t)c * w * h;
+        if (r == r0 || y == 0)
+        {
+            for (int x = 0; x < w; x++)
+                sum[x] = 0;
+            for (int i = y - top; i <= y + bottom; i++)
             {
-                float old_x = x * ax + bx;
-                float old_y = y * ay + by;
-                float interpolated_value = bilinear_interpolate(im, old_x, old_y, c);
-                set_pixel(resized_im, x, y, c, interpolated_value);
+                const int *row = plane + (size_t)clamp_padding(i, 0, h) * w;
+                for (int x = 0; x < w; x++)
+                    sum[x] += row[x];
             }
         }
+        unsigned char *out = job->out.data + (size_t)r * w;
+        for (int x = 0; x < w; x++)
+            out[x] = ((unsigned long long)sum[x] * job->recip + (1u << 23)) >> 24;
+        const int *in = plane + (size_t)clamp_padding(y + bottom + 1, 0, h) * w;
+        const int *gone = plane + (size_t)clamp_padding(y - top, 0, h) * w;
+        for (int x = 0; x < w; x++)
+            sum[x] += in[x] - gone[x];
     }
+    free(sum);
+}
 
-    return resized_im;
+// box_filter_image for 8 bit images. Sums are exact integers and the
+// division by the box area is a multiply by its 24 bit reciprocal, so
+// the cost per pixel doesn't depend on the box size either.
+// int w: width of the box, at most 256.
+image_u8 box_blur_u8(image_u8 im, int w)
+{
+    assert(w >= 1 && w <= 256);
+    box_u8_job job;
+    job.im = im;
+    job.w = w;
+    job.recip = lrint(16777216. / (w * w));
+    job.tmp = malloc((size_t)im.w * im.h * im.c * sizeof(int));
+    job.out = make_image_u8(im.w, im.h, im.c);
+    parallel_for(im.h * im.c, parallel_grain(4. * im.w), box_u8_rows, &job);
+    parallel_for(im.h * im.c, MAX(parallel_grain(4. * im.w), w), box_u8_cols, &job);
+    free(job.tmp);
+    return job.out;
+}
+
+// pyramid_down_into a new image.
+image pyramid_down(image im, float sigma)
+{
+    image out = make_image_layout((im.w + 1) / 2, (im.h + 1) / 2, im.c, im.layout);
+    pyramid_down_into(im, sigma, out);
+    return out;
+}
+
+// Floats a pyramid level takes, rounded up so the next level starts on
+// an IMAGE_ALIGN boundary like any other image.
+size_t level_floats(image level)
+{
+    size_t line = IMAGE_ALIGN / sizeof(float);
+    return ((size_t)level.w * level.h * level.c + line - 1) / line * line;
+}
+
+// Builds a gaussian pyramid. Each level is the one before blurred and
+// halved with pyramid_down, and every level lives in one allocation.
+// Pixel (x, y) of level k sits on pixel (x, y) / scale[k] of level 0.
+// image im: the input, copied into level 0.
+// int levels: number of levels, 1 or more.
+// float sigma: std dev. of the blur between levels.
+// returns: the pyramid, free it with free_pyramid and not free_image.
+pyramid make_pyramid(image im, int levels, float sigma)
+{
+    assert(levels >= 1);
+    pyramid p;
+    p.n = levels;
+    p.scale = calloc(levels, sizeof(float));
+    p.levels = calloc(levels, sizeof(image));
+
+    size_t total = 0;
+    int w = im.w, h = im.h;
+    for (int k = 0; k < levels; k++)
+    {
+        p.levels[k].w = w;
+        p.levels[k].h = h;
+        p.levels[k].c = im.c;
+        p.levels[k].layout = im.layout;
+        p.scale[k] = ldexpf(1, -k);
+        total += level_floats(p.levels[k]);
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    p.data = alloc_pixels(total, 1);
+
+    float *data = p.data;
+    for (int k = 0; k < levels; k++)
+    {
+        p.levels[k].data = data;
+        data += level_floats(p.levels[k]);
+    }
+    copy_to_view(view_image(im), view_image(p.levels[0]));
+    for (int k = 1; k < levels; k++)
+        pyramid_down_into(p.levels[k - 1], sigma, p.levels[k]);
+    return p;
+}
+
+void free_pyramid(pyramid p)
+{
+    free_pixels(p.data);
+    free(p.levels);
+    free(p.scale);
 }
@@ -0,0 +1,49 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Thin wrapper over the widest float vector the compiler targets, so
+// kernels can be written once. Build with AVX=1 for 8 lanes, the x86-64
+// default gives SSE with 4 lanes, anything else falls back to scalar.
+// Loads and stores are unaligned.
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define VLEN 8
+typedef __m256 vfloat;
+#define vload(p) _mm256_loadu_ps(p)
+#define vstore(p, v) _mm256_storeu_ps(p, v)
+#define vset1(x) _mm256_set1_ps(x)
+#define vzero() _mm256_setzero_ps()
+#define vadd(a, b) _mm256_add_ps(a, b)
+#define vsub(a, b) _mm256_sub_ps(a, b)
+#define vmul(a, b) _mm256_mul_ps(a, b)
+#define vmin(a, b) _mm256_min_ps(a, b)
+#define vmax(a, b) _mm256_max_ps(a, b)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define VLEN 4
+typedef __m128 vfloat;
+#define vload(p) _mm_loadu_ps(p)
+#define vstore(p, v) _mm_storeu_ps(p, v)
+#define vset1(x) _mm_set1_ps(x)
+#define vzero() _mm_setzero_ps()
+#define vadd(a, b) _mm_add_ps(a, b)
+#define vsub(a, b) _mm_sub_ps(a, b)
+#define vmul(a, b) _mm_mul_ps(a, b)
+#define vmin(a, b) _mm_min_ps(a, b)
+#define vmax(a, b) _mm_max_ps(a, b)
+#else
+#define VLEN 1
+typedef float vfloat;
+#define vload(p) (*(p))
+#define vstore(p, v) (*(p) = (v))
+#define vset1(x) (x)
+#define vzero() (0.f)
+#define vadd(a, b) ((a) + (b))
+#define vsub(a, b) ((a) - (b))
+#define vmul(a, b) ((a) * (b))
+#define vmin(a, b) MIN(a, b)
+#define vmax(a, b) MAX(a, b)
+#endif
+
+#endif
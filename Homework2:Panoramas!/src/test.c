@@ -165,11 +165,97 @@ void test_bl_resize()
     image resized2 = bilinear_resize(im2, 713, 467);
     image gt2 = load_image("figs/dog-resize-bil.png");
     TEST(same_image(resized2, gt2));
+
+    // on whole pixel positions interpolation gives the pixel back
+    TEST(within_eps(bilinear_interpolate(im2, 10, 7, 1), get_pixel(im2, 10, 7, 1)));
+    image same = bilinear_resize(im2, im2.w, im2.h);
+    TEST(same_image(same, im2));
+    free_image(same);
     free_image(im2);
     free_image(resized2);
     free_image(gt2);
 }
 
+void test_resize_filters()
+{
+    image im = load_image("data/dog.jpg");
+
+    // area averaging by a factor of 2 is the mean of each 2x2 block
+    image half = resize_image(im, im.w/2, im.h/2, RESIZE_AREA);
+    float mean = (get_pixel(im, 20, 30, 1) + get_pixel(im, 21, 30, 1) + get_pixel(im, 20, 31, 1) + get_pixel(im, 21, 31, 1))/4;
+    TEST(within_eps(get_pixel(half, 10, 15, 1), mean));
+
+    // no resampling at scale 1, the kernels vanish on the other pixels
+    image same = resize_image(im, im.w, im.h, RESIZE_LANCZOS3);
+    TEST(same_image(same, im));
+    free_image(same);
+    same = resize_image(im, im.w, im.h, RESIZE_BICUBIC);
+    TEST(same_image(same, im));
+
+    // a one pixel checkerboard shrunk 3x should come out flat gray,
+    // point sampling aliases it to black or white instead
+    image check = make_image(63, 63, 1);
+    int i;
+    for(i = 0; i < 63*63; ++i) check.data[i] = (i%63 + i/63) % 2;
+    image flat = resize_image(check, 21, 21, RESIZE_LANCZOS3);
+    image aliased = bilinear_resize(check, 21, 21);
+    TEST(within_eps(get_pixel(flat, 10, 10, 0), .5));
+    TEST(!within_eps(get_pixel(aliased, 10, 10, 0), .5));
+    free_image(flat);
+    // area averages the 3x3 block, 4 of whose pixels are white
+    flat = resize_image(check, 21, 21, RESIZE_AREA);
+    TEST(within_eps(get_pixel(flat, 10, 10, 0), 4./9));
+
+    free_image(im);
+    free_image(half);
+    free_image(same);
+    free_image(check);
+    free_image(flat);
+    free_image(aliased);
+}
+
+void test_pyramid()
+{
+    image im = load_image("data/dog.jpg");
+    pyramid p = make_pyramid(im, 4, 1);
+    TEST(p.n == 4);
+    TEST(same_image(p.levels[0], im));
+    TEST(p.levels[1].w == (im.w+1)/2 && p.levels[1].h == (im.h+1)/2);
+    TEST(within_eps(p.scale[3], .125));
+    TEST(p.levels[3].data >= p.levels[2].data + p.levels[2].w*p.levels[2].h*im.c);
+    // every level is aligned, odd sizes too
+    image odd = make_image(37, 23, 3);
+    pyramid q = make_pyramid(odd, 4, 1);
+    int aligned = 1;
+    for (int k = 0; k < q.n; k++) aligned &= (size_t)q.levels[k].data % IMAGE_ALIGN == 0;
+    TEST(aligned);
+    free_pyramid(q);
+    free_image(odd);
+
+    // the fused level is the full resolution blur at the even pixels
+    image blur = smooth_image(im, 1);
+    image even = make_image(p.levels[1].w, p.levels[1].h, im.c);
+    int x, y, c;
+    for(c = 0; c < im.c; ++c)
+        for(y = 0; y < even.h; ++y)
+            for(x = 0; x < even.w; ++x)
+                set_pixel(even, x, y, c, get_pixel(blur, 2*x, 2*y, c));
+    TEST(same_image(p.levels[1], even));
+
+    // level 0 corners come first and match the plain detector
+    int n, m;
+    descriptor *d = harris_pyramid_detector(p, 2, 1, 3, &n);
+    descriptor *e = harris_corner_detector(im, 2, 1, 3, &m);
+    TEST(n > m && d[m-1].p.x == e[m-1].p.x && d[m-1].p.y == e[m-1].p.y);
+    free_descriptors(d, n);
+    free_descriptors(e, m);
+
+    free_image(im);
+    free_image(blur);
+    free_image(even);
+    free_pyramid(p);
+}
+
 void test_multiple_resize()
 {
     image im = load_image("data/dog.jpg");
@@ -275,6 +361,166 @@ void test_gaussian_blur(){
     free_image(gt);
 }
 
+void test_1d_gaussian(){
+    image f = make_gaussian_filter(3);
+    image g = make_1d_gaussian(3);
+    TEST(g.w == f.w && g.h == 1 && g.c == 1);
+    image outer = make_image(f.w, f.h, 1);
+    int i, j;
+    for(j = 0; j < outer.h; ++j){
+        for(i = 0; i < outer.w; ++i){
+            outer.data[i + j*outer.w] = g.data[i]*g.data[j];
+        }
+    }
+    TEST(same_image(outer, f));
+    free_image(f);
+    free_image(g);
+    free_image(outer);
+}
+
+void test_separable_convolution(){
+    image im = load_image("data/dog.jpg");
+    image blur = smooth_image(im, 2);
+    clamp_image(blur);
+
+    image gt = load_image("figs/dog-gauss2.png");
+    TEST(same_image(blur, gt));
+
+    image row, col;
+    image f = make_gx_filter();
+    TEST(separate_filter(f, &row, &col));
+    free_image(row);
+    free_image(col);
+    image e = make_emboss_filter();
+    TEST(!separate_filter(e, &row, &col));
+
+    free_image(im);
+    free_image(blur);
+    free_image(gt);
+    free_image(f);
+    free_image(e);
+}
+
+void test_fixed_size_convolution(){
+    image im = load_image("data/dog.jpg");
+    image row, col;
+
+    image box = make_box_filter(5);
+    image fixed5 = convolve_image(im, box, 1);
+    TEST(separate_filter(box, &row, &col));
+    image sep5 = convolve_separable(im, row, col, 1);
+    TEST(same_image(fixed5, sep5));
+    free_image(row);
+    free_image(col);
+
+    image gx = make_gx_filter();
+    image fixed3 = convolve_image(im, gx, 0);
+    TEST(separate_filter(gx, &row, &col));
+    image sep3 = convolve_separable(im, row, col, 0);
+    TEST(same_image(fixed3, sep3));
+    free_image(row);
+    free_image(col);
+
+    free_image(im);
+    free_image(box);
+    free_image(fixed5);
+    free_image(sep5);
+    free_image(gx);
+    free_image(fixed3);
+    free_image(sep3);
+}
+
+void test_recursive_gaussian(){
+    image im = load_image("data/dog.jpg");
+    image g = make_1d_gaussian(12);
+    image fir = convolve_separable(im, g, g, 1);
+    image iir = recursive_gaussian(im, 12);
+    TEST(iir.w == fir.w && iir.h == fir.h && iir.c == fir.c);
+    float maxdiff = 0;
+    int i;
+    for(i = 0; i < fir.w*fir.h*fir.c; ++i){
+        float d = fabsf(fir.data[i] - iir.data[i]);
+        if(d > maxdiff) maxdiff = d;
+    }
+    TEST(maxdiff < .015);
+    free_image(im);
+    free_image(g);
+    free_image(fir);
+    free_image(iir);
+}
+
+void test_integral_image(){
+    image im = load_image("data/dog.jpg");
+    image box = box_filter_image(im, 7);
+    clamp_image(box);
+    image gt = load_image("figs/dog-box7.png");
+    TEST(same_image(box, gt));
+
+    integral_image ii = make_integral_image(im, 2, 1);
+    double sum = 0;
+    int i;
+    for(i = 0; i < im.w*im.h; ++i) sum += im.data[i + im.w*im.h];
+    TEST(within_eps(integral_sum(ii, 0, 0, im.w, im.h, 1), sum));
+    // padding repeats the corner pixel
+    TEST(within_eps(integral_mean(ii, -2, -2, 0, 0, 0), get_pixel(im, 0, 0, 0)));
+    TEST(within_eps(integral_variance(ii, -2, -2, 1, 1, 0), 0));
+    free_integral_image(ii);
+
+    image *mv = local_mean_variance(im, 7);
+    clamp_image(mv[0]);
+    TEST(same_image(mv[0], gt));
+
+    free_image(im);
+    free_image(box);
+    free_image(gt);
+    free_image(mv[0]);
+    free_image(mv[1]);
+    free(mv);
+}
+
+void test_fft_convolution(){
+    image im = load_image("data/dog.jpg");
+    image f = make_emboss_filter();
+    image direct = convolve_image(im, f, 1);
+    image freq = convolve_fft(im, f, 1);
+    TEST(same_image(freq, direct));
+
+    image g = make_gaussian_filter(3);
+    image direct2 = convolve_image(im, g, 0);
+    image freq2 = convolve_fft(im, g, 0);
+    TEST(same_image(freq2, direct2));
+
+    free_image(im);
+    free_image(f);
+    free_image(g);
+    free_image(direct);
+    free_image(freq);
+    free_image(direct2);
+    free_image(freq2);
+}
+
+void test_filter_bank(){
+    image im = load_image("data/dog.jpg");
+    image filters[3];
+    filters[0] = make_gx_filter();
+    filters[1] = make_gy_filter();
+    filters[2] = make_emboss_filter();
+    image bank = convolve_filter_bank(im, filters, 3);
+    TEST(bank.w == im.w && bank.h == im.h && bank.c == 3);
+    int k;
+    for(k = 0; k < 3; ++k){
+        image single = convolve_image(im, filters[k], 0);
+        image plane = bank;
+        plane.c = 1;
+        plane.data += k*im.w*im.h;
+        TEST(same_image(plane, single));
+        free_image(single);
+        free_image(filters[k]);
+    }
+    free_image(im);
+    free_image(bank);
+}
+
 void test_hybrid_image(){
     image man = load_image("data/melisa.png");
     image woman = load_image("data/aria.png");
@@ -358,6 +604,43 @@ void test_sobel(){
     free(res);
 }
 
+void test_sobel_gradient(){
+    image im = load_image("data/dog.jpg");
+    image gx = make_image(im.w, im.h, 1);
+    image gy = make_image(im.w, im.h, 1);
+    image none = {0};
+    sobel_gradient(im, gx, gy, none, none, GRADIENT_EXACT);
+
+    image fx = make_gx_filter();
+    image fy = make_gy_filter();
+    image cx = convolve_image(im, fx, 0);
+    image cy = convolve_image(im, fy, 0);
+    TEST(same_image(gx, cx));
+    TEST(same_image(gy, cy));
+
+    // the fast mode stays within its documented error of libm
+    image mag = make_image(im.w, im.h, 1);
+    image dir = make_image(im.w, im.h, 1);
+    image fmag = make_image(im.w, im.h, 1);
+    image fdir = make_image(im.w, im.h, 1);
+    sobel_gradient(im, none, none, mag, dir, GRADIENT_EXACT);
+    sobel_gradient(im, none, none, fmag, fdir, GRADIENT_FAST);
+    TEST(same_image(fmag, mag));
+    TEST(same_image(fdir, dir));
+
+    free_image(im);
+    free_image(gx);
+    free_image(gy);
+    free_image(mag);
+    free_image(dir);
+    free_image(fmag);
+    free_image(fdir);
+    free_image(fx);
+    free_image(fy);
+    free_image(cx);
+    free_image(cy);
+}
+
 void test_structure()
 {
     image im = load_image("data/dogbw.png");
@@ -384,6 +667,600 @@ void test_cornerness()
     free_image(gt);
 }
 
+// Runs a spread of parallel kernels on im and stacks their results.
+image threaded_kernels(image im)
+{
+    image outs[8];
+    image f = make_gaussian_filter(2);
+    image hp = make_highpass_filter();
+    image odd = make_image(9, 9, 1);
+    int i;
+    for(i = 0; i < 81; ++i) odd.data[i] = (i*37 % 17) / 17. - .5;
+    outs[0] = convolve_image(im, f, 1);
+    outs[1] = convolve_image(im, hp, 1);
+    outs[2] = convolve_image(im, odd, 1);
+    outs[3] = recursive_gaussian(im, 9);
+    outs[4] = box_filter_image(im, 15);
+    outs[5] = bilinear_resize(im, im.w*3/4, im.h*3/4);
+    outs[6] = structure_matrix(im, 2);
+    outs[7] = copy_image(im);
+    rgb_to_hsv(outs[7]);
+
+    int total = 0;
+    for(i = 0; i < 8; ++i) total += outs[i].w*outs[i].h*outs[i].c;
+    image stack = make_image(total, 1, 1);
+    float *p = stack.data;
+    for(i = 0; i < 8; ++i){
+        memcpy(p, outs[i].data, outs[i].w*outs[i].h*outs[i].c*sizeof(float));
+        p += outs[i].w*outs[i].h*outs[i].c;
+        free_image(outs[i]);
+    }
+    free_image(f);
+    free_image(hp);
+    free_image(odd);
+    return stack;
+}
+
+void test_views()
+{
+    image im = load_image("data/dog.jpg");
+    image_view roi = view_region(view_image(im), 100, 50, 200, 150);
+    image crop = copy_view(roi);
+    TEST(crop.w == 200 && crop.h == 150 && crop.c == 3);
+    TEST(within_eps(get_pixel(crop, 7, 9, 2), get_pixel(im, 107, 59, 2)));
+    TEST(within_eps(view_get(roi, -5, 300, 1), get_pixel(im, 100, 199, 1)));
+
+    // kernels on a view give what they give on a copy of it
+    image f = make_emboss_filter();
+    image out = make_image(200, 150, 3);
+    image gt = convolve_image(crop, f, 1);
+    convolve_view(roi, f, 1, view_image(out));
+    TEST(same_image(out, gt));
+    free_image(gt);
+
+    image thumb = make_image(70, 50, 3);
+    gt = resize_image(crop, 70, 50, RESIZE_LANCZOS3);
+    resize_view(roi, view_image(thumb), RESIZE_LANCZOS3);
+    TEST(same_image(thumb, gt));
+    free_image(gt);
+
+    // in place ops only touch the view
+    image copy = copy_image(im);
+    rgb_to_hsv_view(view_region(view_image(copy), 100, 50, 200, 150));
+    rgb_to_hsv(crop);
+    gt = copy_view(view_region(view_image(copy), 100, 50, 200, 150));
+    TEST(same_image(gt, crop));
+    TEST(within_eps(get_pixel(copy, 99, 50, 0), get_pixel(im, 99, 50, 0)));
+    free_image(gt);
+
+    shift_view(view_channels(view_image(copy), 1, 1), 0, .25);
+    TEST(within_eps(get_pixel(copy, 3, 4, 1), get_pixel(im, 3, 4, 1) + .25));
+    TEST(within_eps(get_pixel(copy, 3, 4, 2), get_pixel(im, 3, 4, 2)));
+
+    free_image(im);
+    free_image(crop);
+    free_image(f);
+    free_image(out);
+    free_image(thumb);
+    free_image(copy);
+}
+
+void test_layout()
+{
+    image im = load_image("data/dog.jpg");
+    image hwc = load_image_hwc("data/dog.jpg");
+    TEST(hwc.layout == LAYOUT_HWC && hwc.c == im.c);
+    TEST(within_eps(get_pixel(hwc, 31, 17, 2), get_pixel(im, 31, 17, 2)));
+    TEST(within_eps(hwc.data[(17*hwc.w + 31)*hwc.c + 2], get_pixel(im, 31, 17, 2)));
+    image planar = to_layout(hwc, LAYOUT_CHW);
+    TEST(same_image(planar, im));
+    free_image(planar);
+
+    // color kernels run on the interleaved data directly
+    rgb_to_hsv(hwc);
+    rgb_to_hsv(im);
+    planar = to_layout(hwc, LAYOUT_CHW);
+    TEST(same_image(planar, im));
+    free_image(planar);
+    hsv_to_rgb(hwc);
+    hsv_to_rgb(im);
+
+    // planar-only kernels hand back the layout they were given
+    image f = make_gaussian_filter(2);
+    image blur = convolve_image(hwc, f, 1);
+    image gt = convolve_image(im, f, 1);
+    TEST(blur.layout == LAYOUT_HWC);
+    planar = to_layout(blur, LAYOUT_CHW);
+    TEST(same_image(planar, gt));
+    free_image(planar);
+    free_image(blur);
+    free_image(gt);
+
+    image small = resize_image(hwc, 120, 80, RESIZE_AREA);
+    gt = resize_image(im, 120, 80, RESIZE_AREA);
+    TEST(small.layout == LAYOUT_HWC);
+    planar = to_layout(small, LAYOUT_CHW);
+    TEST(same_image(planar, gt));
+    free_image(planar);
+    free_image(gt);
+
+    save_png(small, "hwc_small");
+    image back = load_image("hwc_small.png");
+    remove("hwc_small.png");
+    planar = to_layout(small, LAYOUT_CHW);
+    TEST(back.w == 120 && fabsf(get_pixel(back, 60, 40, 1) - get_pixel(planar, 60, 40, 1)) < 1./255);
+    free_image(back);
+    free_image(planar);
+
+    free_image(small);
+    free_image(f);
+    free_image(im);
+    free_image(hwc);
+}
+
+void test_padded()
+{
+    image im = load_image("data/dog.jpg");
+    TEST(((size_t)im.data & (IMAGE_ALIGN - 1)) == 0);
+
+    // 1024 floats is 4 KB, rows get an extra cache line
+    image wide = make_padded_image(1024, 8, 3, 0);
+    TEST(wide.ystride == 1024 + IMAGE_ALIGN / sizeof(float));
+    TEST(wide.cstride % (IMAGE_ALIGN / sizeof(float)) == 0 && wide.cstride * sizeof(float) % 4096 != 0);
+    free_image(wide);
+
+    image pad = make_padded_image(im.w, im.h, im.c, 0);
+    TEST(pad.ystride >= im.w && ((size_t)(pad.data + pad.ystride) & (IMAGE_ALIGN - 1)) == 0);
+    copy_to_view(view_image(im), view_image(pad));
+    TEST(within_eps(get_pixel(pad, 101, 77, 2), get_pixel(im, 101, 77, 2)));
+
+    // view kernels run in place, planar ones through a packed copy
+    image f = make_gaussian_filter(2);
+    image blur = convolve_image(pad, f, 1);
+    image gt = convolve_image(im, f, 1);
+    TEST(same_image(blur, gt));
+    free_image(blur);
+    free_image(gt);
+
+    image copy = copy_image(pad);
+    rgb_to_hsv(copy);
+    gt = copy_image(im);
+    rgb_to_hsv(gt);
+    image packed = to_layout(copy, LAYOUT_CHW);
+    TEST(same_image(packed, gt));
+    free_image(packed);
+    free_image(gt);
+    free_image(copy);
+
+    // padding takes no part in the range of feature_normalize
+    copy = copy_image(pad);
+    for (size_t i = 0; i < image_floats(copy); i++) copy.data[i] = 5;
+    copy_to_view(view_image(im), view_image(copy));
+    feature_normalize(copy);
+    gt = copy_image(im);
+    feature_normalize(gt);
+    packed = to_layout(copy, LAYOUT_CHW);
+    TEST(same_image(packed, gt));
+    free_image(packed);
+    free_image(gt);
+    free_image(copy);
+
+    image small = resize_image(pad, 100, 70, RESIZE_BICUBIC);
+    gt = resize_image(im, 100, 70, RESIZE_BICUBIC);
+    TEST(same_image(small, gt));
+    free_image(small);
+    free_image(gt);
+
+    free_image(f);
+    free_image(pad);
+    free_image(im);
+}
+
+void test_buffer_pool()
+{
+    // freed buffers come back to the next image of a similar size
+    image a = make_image(300, 200, 3);
+    float *data = a.data;
+    free_image(a);
+    buffer_pool_stats before = get_buffer_pool_stats();
+    image b = make_image(299, 201, 3);
+    buffer_pool_stats after = get_buffer_pool_stats();
+    TEST(b.data == data && after.hits == before.hits + 1 && after.misses == before.misses);
+    TEST(after.resident < before.resident && after.in_use > before.in_use);
+    TEST(within_eps(get_pixel(b, 298, 200, 2), 0));
+    TEST(((size_t)b.data & (IMAGE_ALIGN - 1)) == 0);
+    free_image(b);
+
+    trim_buffer_pool(0);
+    after = get_buffer_pool_stats();
+    TEST(after.resident < before.resident);
+
+    // with no room in the pool buffers go straight back
+    set_buffer_pool_limit(0);
+    before = get_buffer_pool_stats();
+    free_image(make_image(64, 64, 1));
+    free_image(make_image(64, 64, 1));
+    after = get_buffer_pool_stats();
+    TEST(after.misses == before.misses + 2 && after.hits == before.hits);
+    set_buffer_pool_limit((size_t)256 << 20);
+}
+
+// Largest difference in levels between an 8 bit image and a float one.
+int max_u8_diff(image_u8 a, image b)
+{
+    int worst = 0;
+    for (int i = 0; i < a.w * a.h * a.c; i++)
+    {
+        int d = abs(a.data[i] - (int)roundf(255 * fminf(fmaxf(b.data[i], 0), 1)));
+        worst = MAX(worst, d);
+    }
+    return worst;
+}
+
+void test_storage()
+{
+    image im = load_image("data/dog.jpg");
+    image_u8 u8 = load_image_u8("data/dog.jpg");
+    TEST(u8.w == im.w && u8.h == im.h && u8.c == im.c);
+    image back = u8_to_image(u8);
+    TEST(memcmp(back.data, im.data, (size_t)im.w * im.h * im.c * sizeof(float)) == 0);
+    free_image(back);
+    image_u8 again = image_to_u8(im);
+    TEST(memcmp(again.data, u8.data, (size_t)im.w * im.h * im.c) == 0);
+    free_image_u8(again);
+
+    // half floats keep 11 significant bits
+    TEST(half_to_float(float_to_half(1)) == 1);
+    TEST(half_to_float(float_to_half(-2.5)) == -2.5);
+    TEST(half_to_float(float_to_half(65504)) == 65504);
+    TEST(float_to_half(1e6) == 0x7c00);
+    TEST(half_to_float(float_to_half(0x1p-24f)) == 0x1p-24f);
+    TEST(half_to_float(float_to_half(1 + 0x1p-11f)) == 1);
+    image_f16 f16 = image_to_f16(im);
+    back = f16_to_image(f16);
+    float err = 0;
+    for (int i = 0; i < im.w * im.h * im.c; i++)
+        err = fmaxf(err, fabsf(back.data[i] - im.data[i]));
+    TEST(err <= 0x1p-12f);
+    free_image(back);
+    free_image_f16(f16);
+
+    // native 8 bit kernels stay within a level of the float ones
+    image gray = rgb_to_grayscale(im);
+    image_u8 gray8 = rgb_to_grayscale_u8(u8);
+    TEST(max_u8_diff(gray8, gray) <= 1);
+
+    image small = resize_image(im, 200, 150, RESIZE_AREA);
+    image_u8 small8 = resize_u8(u8, 200, 150, RESIZE_AREA);
+    TEST(max_u8_diff(small8, small) <= 1);
+    free_image(small);
+    free_image_u8(small8);
+    small = resize_image(im, 300, 250, RESIZE_LANCZOS3);
+    small8 = resize_u8(u8, 300, 250, RESIZE_LANCZOS3);
+    TEST(max_u8_diff(small8, small) <= 1);
+    free_image(small);
+    free_image_u8(small8);
+
+    image blur = smooth_image(im, 2);
+    image_u8 blur8 = gaussian_blur_u8(u8, 2);
+    TEST(max_u8_diff(blur8, blur) <= 1);
+    free_image(blur);
+    free_image_u8(blur8);
+
+    blur = box_filter_image(im, 7);
+    blur8 = box_blur_u8(u8, 7);
+    TEST(max_u8_diff(blur8, blur) <= 1);
+    free_image(blur);
+    free_image_u8(blur8);
+
+    threshold_image(gray, .5);
+    threshold_image_u8(gray8, 127);
+    TEST(max_u8_diff(gray8, gray) == 0 || max_u8_diff(gray8, gray) == 255);
+    int agree = 0;
+    for (int i = 0; i < gray.w * gray.h; i++)
+        agree += (gray8.data[i] == 255) == (gray.data[i] == 1);
+    TEST(agree >= gray.w * gray.h - gray.w);
+
+    free_image(gray);
+    free_image_u8(gray8);
+    free_image_u8(u8);
+    free_image(im);
+}
+
+void test_load_gray()
+{
+    image im = load_image("data/dog.jpg");
+    image gt = rgb_to_grayscale(im);
+    image gray = load_image_gray("data/dog.jpg");
+    TEST(gray.c == 1 && gray.w == im.w && gray.h == im.h);
+    TEST(memcmp(gray.data, gt.data, (size_t)im.w * im.h * sizeof(float)) == 0);
+
+    image_u8 u8 = load_image_u8("data/dog.jpg");
+    image_u8 gt8 = rgb_to_grayscale_u8(u8);
+    image_u8 gray8 = load_image_gray_u8("data/dog.jpg");
+    TEST(gray8.c == 1 && memcmp(gray8.data, gt8.data, (size_t)im.w * im.h) == 0);
+
+    // gray files come through as they are
+    image bw = load_image("data/dogbw.png");
+    image bw_gray = load_image_gray("data/dogbw.png");
+    TEST(same_image(bw, bw_gray));
+
+    free_image(bw);
+    free_image(bw_gray);
+    free_image_u8(u8);
+    free_image_u8(gt8);
+    free_image_u8(gray8);
+    free_image(im);
+    free_image(gt);
+    free_image(gray);
+}
+
+void test_interleave()
+{
+    int w = 37, h = 5;
+    unsigned char bytes[37 * 5 * 4];
+    for (int i = 0; i < w * h * 4; i++) bytes[i] = (i * 97 + 13) & 255;
+
+    // every channel count, dropping alpha, in both layouts
+    int cs[] = {1, 2, 3, 4, 4};
+    int keeps[] = {1, 2, 3, 3, 4};
+    for (int t = 0; t < 5; t++)
+    {
+        int c = cs[t], keep = keeps[t], ok = 1;
+        image chw = interleaved_to_image(bytes, w, h, c, keep, LAYOUT_CHW);
+        image hwc = interleaved_to_image(bytes, w, h, c, keep, LAYOUT_HWC);
+        for (int k = 0; k < keep; k++)
+            for (int i = 0; i < w * h; i++)
+            {
+                float v = (float)bytes[i * c + k] / 255.;
+                ok &= chw.data[k * w * h + i] == v && hwc.data[i * keep + k] == v;
+            }
+        TEST(ok && chw.c == keep && hwc.layout == LAYOUT_HWC);
+
+        // and back, to the same bytes
+        unsigned char out[2][37 * 5 * 4];
+        image_to_interleaved(chw, out[0]);
+        image_to_interleaved(hwc, out[1]);
+        ok = 1;
+        for (int i = 0; i < w * h; i++)
+            for (int k = 0; k < keep; k++)
+                ok &= out[0][i * keep + k] == bytes[i * c + k] && out[1][i * keep + k] == bytes[i * c + k];
+        TEST(ok);
+        free_image(chw);
+        free_image(hwc);
+    }
+
+    // out of range values clamp instead of wrapping
+    image im = make_image(2, 1, 1);
+    im.data[0] = -.5;
+    im.data[1] = 1.5;
+    unsigned char out[2];
+    image_to_interleaved(im, out);
+    TEST(out[0] == 0 && out[1] == 255);
+    free_image(im);
+}
+
+void test_native_file()
+{
+    // packed, padded and interleaved images come back bit for bit
+    image im = load_image("data/dog.jpg");
+    image padded = make_padded_image(im.w, im.h, im.c, 0);
+    image hwc = to_layout(im, LAYOUT_HWC);
+    image gray = rgb_to_grayscale(im);
+    image ims[] = {im, padded, hwc, gray};
+    for (int i = 0; i < im.w * im.h * im.c; i++)
+        set_pixel(padded, i % im.w, i / im.w % im.h, i / (im.w * im.h), im.data[i]);
+    for (int t = 0; t < 4; t++)
+    {
+        save_image_native(ims[t], "native_test");
+        image m = map_image("native_test.uwi");
+        TEST(m.data && m.w == ims[t].w && m.h == ims[t].h && m.c == ims[t].c && m.layout == ims[t].layout);
+        if (!m.data) continue;
+        // planes start on page boundaries
+        int aligned = 1;
+        for (int k = 0; k < (m.layout == LAYOUT_HWC ? 1 : m.c); k++)
+            aligned &= ((size_t)(m.data + (size_t)k * image_cstride(m)) & 4095) == 0;
+        TEST(aligned);
+        int ok = 1;
+        for (int k = 0; k < m.c; k++)
+            for (int y = 0; y < m.h; y++)
+                for (int x = 0; x < m.w; x++)
+                    ok &= get_pixel(m, x, y, k) == get_pixel(ims[t], x, y, k);
+        TEST(ok);
+        free_mapped_image(m);
+    }
+
+    // trailing bytes are mapped and unmapped with the rest
+    FILE *f = fopen("native_test.uwi", "ab");
+    fputs("trailing", f);
+    fclose(f);
+    image m = map_image("native_test.uwi");
+    TEST(m.data && m.w == gray.w);
+    free_mapped_image(m);
+
+    // a header that claims more pixels than the file holds is refused
+    int h = gray.h + 1;
+    f = fopen("native_test.uwi", "r+b");
+    fseek(f, 16, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, f);
+    fclose(f);
+    m = map_image("native_test.uwi");
+    TEST(m.data == 0);
+    remove("native_test.uwi");
+
+    image missing = map_image("native_missing.uwi");
+    TEST(missing.data == 0);
+
+    free_image(im);
+    free_image(padded);
+    free_image(hwc);
+    free_image(gray);
+}
+
+void test_tiled_image()
+{
+    image im = load_image("data/dog.jpg");
+    tiled_image t = make_tiled_image("tiled_test.tiles", 700, 600, 3, 1);
+    TEST(t.file != 0);
+    if (!t.file) return;
+    // a cache of four tiles, so most of them go through the file
+    set_tile_cache_limit(t, 0);
+    write_tiled_region(t, im, -100, 50);
+
+    // the window outside the dog is zeros
+    image r = read_tiled_region(t, -10, 0, 720, 620);
+    int ok = 1;
+    for (int k = 0; k < 3; k++)
+        for (int y = 0; y < r.h; y++)
+            for (int x = 0; x < r.w; x++)
+            {
+                int ix = x - 10 + 100, iy = y - 50;
+                int inside = x >= 10 && x < 710 && y < 600 && ix < im.w && iy >= 0 && iy < im.h;
+                ok &= get_pixel(r, x, y, k) == (inside ? get_pixel(im, ix, iy, k) : 0);
+            }
+    TEST(ok);
+    close_tiled_image(t);
+
+    // and it is all there after reopening
+    t = open_tiled_image("tiled_test.tiles");
+    TEST(t.file && t.w == 700 && t.h == 600 && t.c == 3);
+    if (!t.file) return;
+    image edge = read_tile(t, 2, 2);
+    TEST(edge.w == 700 - 512 && edge.h == 600 - 512);
+    image r2 = read_tiled_region(t, -10, 0, 720, 620);
+    TEST(same_image(r2, r));
+
+    // whole tiles are replaced, not merged
+    image gray = make_image(TILE_SIZE, TILE_SIZE, 3);
+    for (int i = 0; i < TILE_SIZE * TILE_SIZE * 3; i++) gray.data[i] = .5;
+    write_tile(t, gray, 1, 0);
+    image back = read_tile(t, 1, 0);
+    TEST(same_image(back, gray));
+    close_tiled_image(t);
+
+    // tiles stored after a flush leave its index alone, so a copy of the
+    // file taken before the next flush, as a crash would leave it, opens
+    t = make_tiled_image("tiled_test.tiles", 8 * TILE_SIZE, TILE_SIZE, 3, 0);
+    set_tile_cache_limit(t, 0);
+    write_tile(t, gray, 0, 0);
+    flush_tiled_image(t);
+    for (int i = 1; i < 8; i++) write_tile(t, gray, i, 0);
+    FILE *in = fopen("tiled_test.tiles", "rb"), *out = fopen("tiled_crash.tiles", "wb");
+    char buff[4096];
+    size_t n;
+    while ((n = fread(buff, 1, sizeof(buff), in)) > 0) fwrite(buff, 1, n, out);
+    fclose(in);
+    fclose(out);
+    tiled_image crash = open_tiled_image("tiled_crash.tiles");
+    TEST(crash.file != 0);
+    if (crash.file)
+    {
+        image first = read_tile(crash, 0, 0);
+        TEST(same_image(first, gray));
+        free_image(first);
+        close_tiled_image(crash);
+    }
+    close_tiled_image(t);
+    remove("tiled_crash.tiles");
+    remove("tiled_test.tiles");
+
+    free_image(im);
+    free_image(r);
+    free_image(r2);
+    free_image(edge);
+    free_image(gray);
+    free_image(back);
+}
+
+void test_image_loader()
+{
+    // more images than the queue holds, in order, a missing one included
+    char *paths[] = {"data/dog.jpg", "data/dogbw.png", "data/missing.png", "data/colorbar.png", "data/dog.jpg"};
+    image_loader l = start_image_loader(paths, 5, 2, 2);
+    image im;
+    int i = 0, ok = 1;
+    while (next_loaded_image(l, &im))
+    {
+        if (i == 2)
+            ok &= im.data == 0;
+        else
+        {
+            image gt = load_image(paths[i]);
+            ok &= im.data && same_image(im, gt);
+            free_image(gt);
+        }
+        free_image(im);
+        i++;
+    }
+    TEST(ok && i == 5);
+    stop_image_loader(l);
+
+    // stopping early frees what was loaded ahead
+    l = start_image_loader(paths, 2, 4, 0);
+    TEST(next_loaded_image(l, &im) && im.w == 768);
+    free_image(im);
+    stop_image_loader(l);
+}
+
+void test_pointwise()
+{
+    image im = load_image("data/dog.jpg");
+
+    // a saturation boost, eagerly and as one fused pass
+    image eager = copy_image(im);
+    rgb_to_hsv(eager);
+    scale_image(eager, 1, 1.5);
+    shift_image(eager, 2, .05);
+    clamp_image(eager);
+    hsv_to_rgb(eager);
+
+    pointwise p = make_pointwise();
+    pointwise_rgb_to_hsv(&p);
+    pointwise_scale(&p, 1, 1.5);
+    pointwise_shift(&p, 2, .05);
+    pointwise_clamp(&p);
+    pointwise_hsv_to_rgb(&p);
+    TEST(p.n == 5);
+    image fused = copy_image(im);
+    run_pointwise(&p, fused);
+    TEST(memcmp(eager.data, fused.data, (size_t)im.w * im.h * im.c * sizeof(float)) == 0);
+
+    // interleaved and cropped images go through gathered blocks
+    image hwc = to_layout(im, LAYOUT_HWC);
+    run_pointwise(&p, hwc);
+    image planar = to_layout(hwc, LAYOUT_CHW);
+    TEST(memcmp(eager.data, planar.data, (size_t)im.w * im.h * im.c * sizeof(float)) == 0);
+    free_image(planar);
+
+    image copy = copy_image(im);
+    run_pointwise_view(&p, view_region(view_image(copy), 10, 20, 300, 100));
+    TEST(within_eps(get_pixel(copy, 50, 50, 1), get_pixel(eager, 50, 50, 1)));
+    TEST(within_eps(get_pixel(copy, 5, 50, 1), get_pixel(im, 5, 50, 1)));
+
+    free_image(copy);
+    free_image(hwc);
+    free_image(fused);
+    free_image(eager);
+    free_image(im);
+}
+
+void test_threads()
+{
+    image im = load_image("data/dog.jpg");
+    set_num_threads(1);
+    TEST(get_num_threads() == 1);
+    image serial = threaded_kernels(im);
+    set_num_threads(4);
+    TEST(get_num_threads() == 4);
+    image threaded = threaded_kernels(im);
+    // not just close, bit for bit the same
+    TEST(serial.w == threaded.w && memcmp(serial.data, threaded.data, serial.w*sizeof(float)) == 0);
+    set_num_threads(0);
+    free_image(im);
+    free_image(serial);
+    free_image(threaded);
+}
+
 void run_tests()
 {
     //test_matrix();
@@ -396,6 +1273,8 @@ void run_tests()
     test_hsv_to_rgb();
     test_nn_resize();
     test_bl_resize();
+    test_resize_filters();
+    test_pyramid();
     test_multiple_resize();
     test_gaussian_filter();
     test_sharpen_filter();
@@ -403,11 +1282,31 @@ void run_tests()
     test_highpass_filter();
     test_convolution();
     test_gaussian_blur();
+    test_1d_gaussian();
+    test_separable_convolution();
+    test_fixed_size_convolution();
+    test_recursive_gaussian();
+    test_integral_image();
+    test_fft_convolution();
+    test_filter_bank();
     test_hybrid_image();
     test_frequency_image();
     test_sobel();
+    test_sobel_gradient();
     test_structure();
     test_cornerness();
+    test_views();
+    test_layout();
+    test_padded();
+    test_buffer_pool();
+    test_storage();
+    test_load_gray();
+    test_interleave();
+    test_native_file();
+    test_tiled_image();
+    test_image_loader();
+    test_pointwise();
+    test_threads();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef ZLIB
+#include <zlib.h>
+#endif
+#include "image.h"
+
+// Images too big for memory, kept on disk in TILE_SIZE square tiles and
+// read and written a window at a time through a cache of recently used
+// tiles. Tiles are stored whole, edge tiles included, as CHW floats, and
+// compressed with zlib when the file asks for it and the library is
+// built with ZLIB=1. Tiles that were never written or are all zeros take
+// no space, so a mostly empty panorama canvas stays small.
+//
+// The file is a header, the tiles in the order they were first written
+// and, from flush_tiled_image, an index of where each tile is. A tile
+// that grows past its space moves to the end of the file. Each flush
+// appends a new index and only then points the header at it, leaving
+// the old one behind as dead space.
+
+#define TILED_MAGIC "UWTILE\r\n"
+#define TILED_VERSION 1
+#define TILED_DEFAULT_CACHE ((size_t)256 << 20)
+
+typedef struct{
+    char magic[8];
+    int version;
+    int w, h, c;
+    int tile;
+    int compress;
+    long long index;        // offset of the tile index, 0 before a flush
+} tiled_header;
+
+// Where a tile is in the file. bytes is 0 for a tile of zeros and the
+// size of the tile when it is stored raw.
+typedef struct{
+    long long offset;
+    int bytes;
+    int capacity;           // bytes reserved at offset
+} tile_entry;
+
+// A tile in the cache, on a list with the most recently used first.
+typedef struct{
+    int tile;               // index of the tile held
+    int dirty;
+    int prev, next;
+    float *data;
+} tile_slot;
+
+struct tiled_file{
+    int fd;
+    int tx, ty;             // tiles across and down
+    long long end;          // where the next new tile goes
+    tile_entry *index;
+    int *slot_of;           // cache slot of each tile, -1 if not cached
+    tile_slot *slots;
+    int nslots, used;
+    int head, tail;
+    pthread_mutex_t lock;
+};
+
+// Floats in a tile of an image with c channels.
+static inline size_t tile_floats(int c)
+{
+    return (size_t)TILE_SIZE * TILE_SIZE * c;
+}
+
+// Allocates the bookkeeping of a tiled image of the given size.
+struct tiled_file *make_tiled_file(int fd, int w, int h)
+{
+    struct tiled_file *f = calloc(1, sizeof(struct tiled_file));
+    f->fd = fd;
+    f->tx = (w + TILE_SIZE - 1) / TILE_SIZE;
+    f->ty = (h + TILE_SIZE - 1) / TILE_SIZE;
+    f->index = calloc((size_t)f->tx * f->ty, sizeof(tile_entry));
+    f->slot_of = malloc((size_t)f->tx * f->ty * sizeof(int));
+    for (int i = 0; i < f->tx * f->ty; i++)
+        f->slot_of[i] = -1;
+    f->head = f->tail = -1;
+    f->end = sizeof(tiled_header);
+    pthread_mutex_init(&f->lock, 0);
+    return f;
+}
+
+// Frees the bookkeeping and the cached tiles of a tiled image.
+void free_tiled_file(struct tiled_file *f)
+{
+    for (int s = 0; s < f->used; s++)
+        free_pixels(f->slots[s].data);
+    pthread_mutex_destroy(&f->lock);
+    free(f->slots);
+    free(f->slot_of);
+    free(f->index);
+    free(f);
+}
+
+// Creates a tiled image file of zeros, replacing any file of that name.
+// Nothing but the header is written until tiles are.
+// const char *filename: the file.
+// int w, h, c: size of the image, which can be far larger than memory.
+// int compress: whether to compress the tiles, which needs ZLIB=1.
+// returns: the image, with file 0 if it can't be created.
+tiled_image make_tiled_image(const char *filename, int w, int h, int c, int compress)
+{
+    tiled_image t = {w, h, c, compress, 0};
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tiled_header hd = {TILED_MAGIC, TILED_VERSION, w, h, c, TILE_SIZE, compress, 0};
+    if (fd < 0 || pwrite(fd, &hd, sizeof(hd), 0) != sizeof(hd))
+    {
+        fprintf(stderr, "Cannot create tiled image \"%s\"\n", filename);
+        if (fd >= 0) close(fd);
+        return t;
+    }
+    t.file = make_tiled_file(fd, w, h);
+    set_tile_cache_limit(t, TILED_DEFAULT_CACHE);
+    return t;
+}
+
+// Opens a tiled image written by make_tiled_image to read and change it.
+// returns: the image, with file 0 if it can't be opened.
+tiled_image open_tiled_image(const char *filename)
+{
+    tiled_image t = {0};
+    tiled_header hd;
+    int fd = open(filename, O_RDWR);
+    if (fd < 0 || pread(fd, &hd, sizeof(hd), 0) != sizeof(hd) ||
+        memcmp(hd.magic, TILED_MAGIC, sizeof(hd.magic)) || hd.version != TILED_VERSION ||
+        hd.tile != TILE_SIZE || hd.index == 0)
+    {
+        fprintf(stderr, "Cannot open tiled image \"%s\"\n", filename);
+        if (fd >= 0) close(fd);
+        return t;
+    }
+    struct tiled_file *f = make_tiled_file(fd, hd.w, hd.h);
+    size_t bytes = (size_t)f->tx * f->ty * sizeof(tile_entry);
+    if (pread(fd, f->index, bytes, hd.index) != (ssize_t)bytes)
+    {
+        fprintf(stderr, "Cannot open tiled image \"%s\": index is missing\n", filename);
+        free_tiled_file(f);
+        close(fd);
+        return t;
+    }
+    // new tiles go after the index, which stays valid until the next flush
+    f->end = hd.index + bytes;
+    t.w = hd.w;
+    t.h = hd.h;
+    t.c = hd.c;
+    t.compress = hd.compress;
+    t.file = f;
+    set_tile_cache_limit(t, TILED_DEFAULT_CACHE);
+    return t;
+}
+
+// Writes a tile back to the file.
+void store_tile(tiled_image t, int tile, const float *data)
+{
+    struct tiled_file *f = t.file;
+    tile_entry *e = f->index + tile;
+    size_t n = tile_floats(t.c);
+    size_t i = 0;
+    while (i < n && data[i] == 0) i++;
+    if (i == n)
+    {
+        // zeros keep their space in case the tile comes back
+        e->bytes = 0;
+        return;
+    }
+
+    const void *src = data;
+    size_t bytes = n * sizeof(float);
+    void *packed = 0;
+#ifdef ZLIB
+    if (t.compress)
+    {
+        uLongf len = compressBound(bytes);
+        packed = alloc_buffer(len, 0);
+        if (compress2(packed, &len, (const Bytef *)data, bytes, 1) == Z_OK && len < bytes)
+        {
+            src = packed;
+            bytes = len;
+        }
+    }
+#endif
+    if ((int)bytes > e->capacity)
+    {
+        e->offset = f->end;
+        e->capacity = bytes;
+        f->end += bytes;
+    }
+    e->bytes = bytes;
+    if (pwrite(f->fd, src, bytes, e->offset) != (ssize_t)bytes)
+        fprintf(stderr, "Failed to write tile %d\n", tile);
+    free_buffer(packed);
+}
+
+// Reads a tile from the file.
+void fetch_tile(tiled_image t, int tile, float *data)
+{
+    struct tiled_file *f = t.file;
+    tile_entry *e = f->index + tile;
+    size_t bytes = tile_floats(t.c) * sizeof(float);
+    if (e->bytes == 0)
+    {
+        memset(data, 0, bytes);
+        return;
+    }
+    if ((size_t)e->bytes == bytes)
+    {
+        if (pread(f->fd, data, bytes, e->offset) != (ssize_t)bytes)
+            fprintf(stderr, "Failed to read tile %d\n", tile);
+        return;
+    }
+#ifdef ZLIB
+    void *packed = alloc_buffer(e->bytes, 0);
+    uLongf len = bytes;
+    if (pread(f->fd, packed, e->bytes, e->offset) != e->bytes ||
+        uncompress((Bytef *)data, &len, packed, e->bytes) != Z_OK || len != bytes)
+    {
+        fprintf(stderr, "Failed to read tile %d\n", tile);
+        memset(data, 0, bytes);
+    }
+    free_buffer(packed);
+#else
+    fprintf(stderr, "Tile %d is compressed, build with ZLIB=1 to read it\n", tile);
+    memset(data, 0, bytes);
+#endif
+}
+
+// Takes a cache slot off the use list.
+void unlink_slot(struct tiled_file *f, int s)
+{
+    tile_slot *sl = f->slots + s;
+    if (sl->prev >= 0) f->slots[sl->prev].next = sl->next;
+    else f->head = sl->next;
+    if (sl->next >= 0) f->slots[sl->next].prev = sl->prev;
+    else f->tail = sl->prev;
+}
+
+// Puts a cache slot at the front of the use list.
+void push_slot(struct tiled_file *f, int s)
+{
+    tile_slot *sl = f->slots + s;
+    sl->prev = -1;
+    sl->next = f->head;
+    if (f->head >= 0) f->slots[f->head].prev = s;
+    f->head = s;
+    if (f->tail < 0) f->tail = s;
+}
+
+// Finds a tile in the cache, loading it if it isn't there, and marks it
+// as the most recently used. Call with the lock held.
+// int whole: the caller overwrites the whole tile, don't read it.
+// returns: the pixels of the tile, TILE_SIZE square, CHW.
+float *cache_tile(tiled_image t, int tile, int whole)
+{
+    struct tiled_file *f = t.file;
+    int s = f->slot_of[tile];
+    if (s >= 0)
+    {
+        unlink_slot(f, s);
+        push_slot(f, s);
+        return f->slots[s].data;
+    }
+    if (f->used < f->nslots)
+    {
+        s = f->used++;
+        f->slots[s].data = alloc_pixels(tile_floats(t.c), 0);
+    }
+    else
+    {
+        // evict the least recently used tile
+        s = f->tail;
+        unlink_slot(f, s);
+        tile_slot *old = f->slots + s;
+        if (old->dirty) store_tile(t, old->tile, old->data);
+        f->slot_of[old->tile] = -1;
+    }
+    tile_slot *sl = f->slots + s;
+    sl->tile = tile;
+    sl->dirty = 0;
+    f->slot_of[tile] = s;
+    push_slot(f, s);
+    if (!whole) fetch_tile(t, tile, sl->data);
+    return sl->data;
+}
+
+// Sets how much memory the tile cache of an image may use, 256 MB by
+// default. It always holds at least four tiles.
+void set_tile_cache_limit(tiled_image t, size_t bytes)
+{
+    struct tiled_file *f = t.file;
+    if (!f) return;
+    pthread_mutex_lock(&f->lock);
+    int n = MAX(4, bytes / (tile_floats(t.c) * sizeof(float)));
+    // drop the least recently used tiles that no longer fit
+    while (f->used > n)
+    {
+        int s = f->tail;
+        unlink_slot(f, s);
+        if (f->slots[s].dirty) store_tile(t, f->slots[s].tile, f->slots[s].data);
+        f->slot_of[f->slots[s].tile] = -1;
+        free_pixels(f->slots[s].data);
+        // keep the slots in use at the front of the array
+        int last = --f->used;
+        if (s != last)
+        {
+            f->slots[s] = f->slots[last];
+            tile_slot *sl = f->slots + s;
+            f->slot_of[sl->tile] = s;
+            if (sl->prev >= 0) f->slots[sl->prev].next = s; else f->head = s;
+            if (sl->next >= 0) f->slots[sl->next].prev = s; else f->tail = s;
+        }
+    }
+    f->slots = realloc(f->slots, n * sizeof(tile_slot));
+    f->nslots = n;
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Copies between a window of a tiled image and an image, tile by tile.
+// int write: copy the image into the tiled image rather than out of it.
+void copy_tiled_region(tiled_image t, image im, int x, int y, int write)
+{
+    struct tiled_file *f = t.file;
+    int x0 = MAX(x, 0), y0 = MAX(y, 0);
+    int x1 = MIN(x + im.w, t.w), y1 = MIN(y + im.h, t.h);
+    int c = MIN(im.c, t.c);
+    if (x0 >= x1 || y0 >= y1)
+        return;
+    pthread_mutex_lock(&f->lock);
+    for (int ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ty++)
+    {
+        for (int tx = x0 / TILE_SIZE; tx * TILE_SIZE < x1; tx++)
+        {
+            // overlap of the window and the tile, in image coordinates
+            int ax = MAX(x0, tx * TILE_SIZE), bx = MIN(x1, (tx + 1) * TILE_SIZE);
+            int ay = MAX(y0, ty * TILE_SIZE), by = MIN(y1, (ty + 1) * TILE_SIZE);
+            int whole = write && c == t.c && bx - ax == TILE_SIZE && by - ay == TILE_SIZE;
+            int tile = ty * f->tx + tx;
+            float *data = cache_tile(t, tile, whole);
+            if (write) f->slots[f->slot_of[tile]].dirty = 1;
+            size_t n = (bx - ax) * sizeof(float);
+            for (int k = 0; k < c; k++)
+            {
+                for (int j = ay; j < by; j++)
+                {
+                    float *p = data + ((size_t)k * TILE_SIZE + j - ty * TILE_SIZE) * TILE_SIZE + ax - tx * TILE_SIZE;
+                    float *q = im.data + ((size_t)k * im.h + j - y) * im.w + ax - x;
+                    if (write) memcpy(p, q, n);
+                    else memcpy(q, p, n);
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Reads a window of a tiled image.
+// int x, y: top left corner of the window, which may stick out of the
+// image. Pixels outside it are 0.
+// int w, h: size of the window.
+// returns: the w x h window.
+image read_tiled_region(tiled_image t, int x, int y, int w, int h)
+{
+    image out = make_image(w, h, t.c);
+    copy_tiled_region(t, out, x, y, 0);
+    return out;
+}
+
+// Writes an image into a tiled image, the parts of it that fall outside
+// are dropped.
+// int x, y: where the top left corner of im goes.
+void write_tiled_region(tiled_image t, image im, int x, int y)
+{
+    if (!is_packed_chw(im))
+    {
+        image planar = to_layout(im, LAYOUT_CHW);
+        write_tiled_region(t, planar, x, y);
+        free_image(planar);
+        return;
+    }
+    copy_tiled_region(t, im, x, y, 1);
+}
+
+// Reads tile tx, ty, clipped to the image at the right and bottom edges.
+image read_tile(tiled_image t, int tx, int ty)
+{
+    int x = tx * TILE_SIZE, y = ty * TILE_SIZE;
+    return read_tiled_region(t, x, y, MIN(TILE_SIZE, t.w - x), MIN(TILE_SIZE, t.h - y));
+}
+
+void write_tile(tiled_image t, image tile, int tx, int ty)
+{
+    write_tiled_region(t, tile, tx * TILE_SIZE, ty * TILE_SIZE);
+}
+
+// Writes every changed tile and the index to the file, after which it
+// can be opened again with open_tiled_image.
+void flush_tiled_image(tiled_image t)
+{
+    struct tiled_file *f = t.file;
+    if (!f) return;
+    pthread_mutex_lock(&f->lock);
+    for (int s = 0; s < f->used; s++)
+    {
+        if (f->slots[s].dirty) store_tile(t, f->slots[s].tile, f->slots[s].data);
+        f->slots[s].dirty = 0;
+    }
+    // the new index goes after everything the old one points to and is
+    // on disk before the header points to it, so the file can be opened
+    // whenever the process stops
+    size_t bytes = (size_t)f->tx * f->ty * sizeof(tile_entry);
+    tiled_header hd = {TILED_MAGIC, TILED_VERSION, t.w, t.h, t.c, TILE_SIZE, t.compress, f->end};
+    if (pwrite(f->fd, f->index, bytes, f->end) != (ssize_t)bytes ||
+        fdatasync(f->fd) ||
+        pwrite(f->fd, &hd, sizeof(hd), 0) != sizeof(hd))
+        fprintf(stderr, "Failed to write tiled image index\n");
+    f->end += bytes;
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Flushes a tiled image and frees its cache.
+void close_tiled_image(tiled_image t)
+{
+    struct tiled_file *f = t.file;
+    if (!f) return;
+    flush_tiled_image(t);
+    close(f->fd);
+    free_tiled_file(f);
+}
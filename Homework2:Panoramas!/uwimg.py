@@ -10,16 +10,37 @@ def c_array(ctype, values):
     arr[:] = values
     return arr
 
+LAYOUT_CHW = 0
+LAYOUT_HWC = 1
+
 class IMAGE(Structure):
     _fields_ = [("w", c_int),
                 ("h", c_int),
                 ("c", c_int),
-                ("data", POINTER(c_float))]
+                ("data", POINTER(c_float)),
+                ("layout", c_int),
+                ("ystride", c_int),
+                ("cstride", c_int)]
     def __add__(self, other):
         return add_image(self, other)
     def __sub__(self, other):
         return sub_image(self, other)
 
+class IMAGE_VIEW(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("xstride", c_int),
+                ("ystride", c_int),
+                ("cstride", c_int),
+                ("data", POINTER(c_float))]
+
+class PYRAMID(Structure):
+    _fields_ = [("n", c_int),
+                ("scale", POINTER(c_float)),
+                ("levels", POINTER(IMAGE)),
+                ("data", POINTER(c_float))]
+
 class POINT(Structure):
     _fields_ = [("x", c_float),
                 ("y", c_float)]
@@ -87,6 +108,39 @@ load_image_lib.restype = IMAGE
 def load_image(f):
     return load_image_lib(f.encode('ascii'))
 
+class IMAGE_LOADER(Structure):
+    _fields_ = [("n", c_int),
+                ("queue", c_void_p)]
+
+start_image_loader = lib.start_image_loader
+start_image_loader.argtypes = [POINTER(c_char_p), c_int, c_int, c_int]
+start_image_loader.restype = IMAGE_LOADER
+
+next_loaded_image = lib.next_loaded_image
+next_loaded_image.argtypes = [IMAGE_LOADER, POINTER(IMAGE)]
+next_loaded_image.restype = c_int
+
+stop_image_loader = lib.stop_image_loader
+stop_image_loader.argtypes = [IMAGE_LOADER]
+stop_image_loader.restype = None
+
+# Yields the images of a list of files in order, decoding up to depth
+# of them in the background while the caller works on the last one.
+# Raises IOError naming the file if one can't be loaded.
+def load_images(paths, depth=4, threads=0):
+    files = c_array(c_char_p, [f.encode('ascii') for f in paths])
+    l = start_image_loader(files, len(paths), depth, threads)
+    try:
+        for path in paths:
+            im = IMAGE()
+            if not next_loaded_image(l, byref(im)):
+                break
+            if not im.data:
+                raise IOError(path)
+            yield im
+    finally:
+        stop_image_loader(l)
+
 save_png_lib = lib.save_png
 save_png_lib.argtypes = [IMAGE, c_char_p]
 save_png_lib.restype = None
@@ -101,6 +155,75 @@ save_image_lib.restype = None
 def save_image(im, f):
     return save_image_lib(im, f.encode('ascii'))
 
+save_image_native_lib = lib.save_image_native
+save_image_native_lib.argtypes = [IMAGE, c_char_p]
+save_image_native_lib.restype = None
+
+def save_image_native(im, f):
+    return save_image_native_lib(im, f.encode('ascii'))
+
+map_image_lib = lib.map_image
+map_image_lib.argtypes = [c_char_p]
+map_image_lib.restype = IMAGE
+
+def map_image(f):
+    return map_image_lib(f.encode('ascii'))
+
+free_mapped_image = lib.free_mapped_image
+free_mapped_image.argtypes = [IMAGE]
+free_mapped_image.restype = None
+
+TILE_SIZE = 256
+
+class TILED_IMAGE(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("compress", c_int),
+                ("file", c_void_p)]
+
+make_tiled_image_lib = lib.make_tiled_image
+make_tiled_image_lib.argtypes = [c_char_p, c_int, c_int, c_int, c_int]
+make_tiled_image_lib.restype = TILED_IMAGE
+
+def make_tiled_image(f, w, h, c, compress=0):
+    return make_tiled_image_lib(f.encode('ascii'), w, h, c, compress)
+
+open_tiled_image_lib = lib.open_tiled_image
+open_tiled_image_lib.argtypes = [c_char_p]
+open_tiled_image_lib.restype = TILED_IMAGE
+
+def open_tiled_image(f):
+    return open_tiled_image_lib(f.encode('ascii'))
+
+set_tile_cache_limit = lib.set_tile_cache_limit
+set_tile_cache_limit.argtypes = [TILED_IMAGE, c_size_t]
+set_tile_cache_limit.restype = None
+
+read_tiled_region = lib.read_tiled_region
+read_tiled_region.argtypes = [TILED_IMAGE, c_int, c_int, c_int, c_int]
+read_tiled_region.restype = IMAGE
+
+write_tiled_region = lib.write_tiled_region
+write_tiled_region.argtypes = [TILED_IMAGE, IMAGE, c_int, c_int]
+write_tiled_region.restype = None
+
+read_tile = lib.read_tile
+read_tile.argtypes = [TILED_IMAGE, c_int, c_int]
+read_tile.restype = IMAGE
+
+write_tile = lib.write_tile
+write_tile.argtypes = [TILED_IMAGE, IMAGE, c_int, c_int]
+write_tile.restype = None
+
+flush_tiled_image = lib.flush_tiled_image
+flush_tiled_image.argtypes = [TILED_IMAGE]
+flush_tiled_image.restype = None
+
+close_tiled_image = lib.close_tiled_image
+close_tiled_image.argtypes = [TILED_IMAGE]
+close_tiled_image.restype = None
+
 same_image = lib.same_image
 same_image.argtypes = [IMAGE, IMAGE]
 same_image.restype = c_int
@@ -113,6 +236,27 @@ bilinear_resize = lib.bilinear_resize
 bilinear_resize.argtypes = [IMAGE, c_int, c_int]
 bilinear_resize.restype = IMAGE
 
+RESIZE_BILINEAR = 0
+RESIZE_AREA = 1
+RESIZE_BICUBIC = 2
+RESIZE_LANCZOS3 = 3
+
+resize_image = lib.resize_image
+resize_image.argtypes = [IMAGE, c_int, c_int, c_int]
+resize_image.restype = IMAGE
+
+pyramid_down = lib.pyramid_down
+pyramid_down.argtypes = [IMAGE, c_float]
+pyramid_down.restype = IMAGE
+
+make_pyramid = lib.make_pyramid
+make_pyramid.argtypes = [IMAGE, c_int, c_float]
+make_pyramid.restype = PYRAMID
+
+free_pyramid = lib.free_pyramid
+free_pyramid.argtypes = [PYRAMID]
+free_pyramid.restype = None
+
 make_sharpen_filter = lib.make_sharpen_filter
 make_sharpen_filter.argtypes = []
 make_sharpen_filter.restype = IMAGE
@@ -181,6 +325,191 @@ panorama_image_lib = lib.panorama_image
 panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int]
 panorama_image_lib.restype = IMAGE
 
+POINTWISE_MAX_OPS = 32
+
+class POINTWISE_OP(Structure):
+    _fields_ = [("op", c_int),
+                ("c", c_int),
+                ("v", c_float)]
+
+class POINTWISE(Structure):
+    _fields_ = [("n", c_int),
+                ("ops", POINTWISE_OP * POINTWISE_MAX_OPS)]
+
+make_pointwise = lib.make_pointwise
+make_pointwise.argtypes = []
+make_pointwise.restype = POINTWISE
+
+pointwise_shift = lib.pointwise_shift
+pointwise_shift.argtypes = [POINTER(POINTWISE), c_int, c_float]
+pointwise_shift.restype = None
+
+pointwise_scale = lib.pointwise_scale
+pointwise_scale.argtypes = [POINTER(POINTWISE), c_int, c_float]
+pointwise_scale.restype = None
+
+pointwise_clamp = lib.pointwise_clamp
+pointwise_clamp.argtypes = [POINTER(POINTWISE)]
+pointwise_clamp.restype = None
+
+pointwise_rgb_to_hsv = lib.pointwise_rgb_to_hsv
+pointwise_rgb_to_hsv.argtypes = [POINTER(POINTWISE)]
+pointwise_rgb_to_hsv.restype = None
+
+pointwise_hsv_to_rgb = lib.pointwise_hsv_to_rgb
+pointwise_hsv_to_rgb.argtypes = [POINTER(POINTWISE)]
+pointwise_hsv_to_rgb.restype = None
+
+run_pointwise = lib.run_pointwise
+run_pointwise.argtypes = [POINTER(POINTWISE), IMAGE]
+run_pointwise.restype = None
+
+class IMAGE_U8(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("data", POINTER(c_ubyte))]
+
+class IMAGE_F16(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("data", POINTER(c_ushort))]
+
+load_image_u8_lib = lib.load_image_u8
+load_image_u8_lib.argtypes = [c_char_p]
+load_image_u8_lib.restype = IMAGE_U8
+
+def load_image_u8(f):
+    return load_image_u8_lib(f.encode('ascii'))
+
+load_image_gray_lib = lib.load_image_gray
+load_image_gray_lib.argtypes = [c_char_p]
+load_image_gray_lib.restype = IMAGE
+
+def load_image_gray(f):
+    return load_image_gray_lib(f.encode('ascii'))
+
+load_image_gray_u8_lib = lib.load_image_gray_u8
+load_image_gray_u8_lib.argtypes = [c_char_p]
+load_image_gray_u8_lib.restype = IMAGE_U8
+
+def load_image_gray_u8(f):
+    return load_image_gray_u8_lib(f.encode('ascii'))
+
+free_image_u8 = lib.free_image_u8
+free_image_u8.argtypes = [IMAGE_U8]
+free_image_u8.restype = None
+
+free_image_f16 = lib.free_image_f16
+free_image_f16.argtypes = [IMAGE_F16]
+free_image_f16.restype = None
+
+image_to_u8 = lib.image_to_u8
+image_to_u8.argtypes = [IMAGE]
+image_to_u8.restype = IMAGE_U8
+
+u8_to_image = lib.u8_to_image
+u8_to_image.argtypes = [IMAGE_U8]
+u8_to_image.restype = IMAGE
+
+image_to_f16 = lib.image_to_f16
+image_to_f16.argtypes = [IMAGE]
+image_to_f16.restype = IMAGE_F16
+
+f16_to_image = lib.f16_to_image
+f16_to_image.argtypes = [IMAGE_F16]
+f16_to_image.restype = IMAGE
+
+rgb_to_grayscale_u8 = lib.rgb_to_grayscale_u8
+rgb_to_grayscale_u8.argtypes = [IMAGE_U8]
+rgb_to_grayscale_u8.restype = IMAGE_U8
+
+resize_u8 = lib.resize_u8
+resize_u8.argtypes = [IMAGE_U8, c_int, c_int, c_int]
+resize_u8.restype = IMAGE_U8
+
+gaussian_blur_u8 = lib.gaussian_blur_u8
+gaussian_blur_u8.argtypes = [IMAGE_U8, c_float]
+gaussian_blur_u8.restype = IMAGE_U8
+
+box_blur_u8 = lib.box_blur_u8
+box_blur_u8.argtypes = [IMAGE_U8, c_int]
+box_blur_u8.restype = IMAGE_U8
+
+threshold_image_u8 = lib.threshold_image_u8
+threshold_image_u8.argtypes = [IMAGE_U8, c_ubyte]
+threshold_image_u8.restype = None
+
+class BUFFER_POOL_STATS(Structure):
+    _fields_ = [("hits", c_size_t),
+                ("misses", c_size_t),
+                ("resident", c_size_t),
+                ("in_use", c_size_t)]
+
+get_buffer_pool_stats = lib.get_buffer_pool_stats
+get_buffer_pool_stats.argtypes = []
+get_buffer_pool_stats.restype = BUFFER_POOL_STATS
+
+trim_buffer_pool = lib.trim_buffer_pool
+trim_buffer_pool.argtypes = [c_size_t]
+trim_buffer_pool.restype = None
+
+set_buffer_pool_limit = lib.set_buffer_pool_limit
+set_buffer_pool_limit.argtypes = [c_size_t]
+set_buffer_pool_limit.restype = None
+
+make_padded_image = lib.make_padded_image
+make_padded_image.argtypes = [c_int, c_int, c_int, c_int]
+make_padded_image.restype = IMAGE
+
+to_layout = lib.to_layout
+to_layout.argtypes = [IMAGE, c_int]
+to_layout.restype = IMAGE
+
+load_image_hwc_lib = lib.load_image_hwc
+load_image_hwc_lib.argtypes = [c_char_p]
+load_image_hwc_lib.restype = IMAGE
+
+def load_image_hwc(f):
+    return load_image_hwc_lib(f.encode('ascii'))
+
+view_image = lib.view_image
+view_image.argtypes = [IMAGE]
+view_image.restype = IMAGE_VIEW
+
+view_region = lib.view_region
+view_region.argtypes = [IMAGE_VIEW, c_int, c_int, c_int, c_int]
+view_region.restype = IMAGE_VIEW
+
+view_channels = lib.view_channels
+view_channels.argtypes = [IMAGE_VIEW, c_int, c_int]
+view_channels.restype = IMAGE_VIEW
+
+copy_view = lib.copy_view
+copy_view.argtypes = [IMAGE_VIEW]
+copy_view.restype = IMAGE
+
+copy_to_view = lib.copy_to_view
+copy_to_view.argtypes = [IMAGE_VIEW, IMAGE_VIEW]
+copy_to_view.restype = None
+
+convolve_view = lib.convolve_view
+convolve_view.argtypes = [IMAGE_VIEW, IMAGE, c_int, IMAGE_VIEW]
+convolve_view.restype = None
+
+resize_view = lib.resize_view
+resize_view.argtypes = [IMAGE_VIEW, IMAGE_VIEW, c_int]
+resize_view.restype = None
+
+set_num_threads = lib.set_num_threads
+set_num_threads.argtypes = [c_int]
+set_num_threads.restype = None
+
+get_num_threads = lib.get_num_threads
+get_num_threads.argtypes = []
+get_num_threads.restype = c_int
+
 def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
     return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
 